@@ -8,7 +8,62 @@
 int Storage_ObjectExists(const char* name); // BLOCKING
 cap_t Storage_FindObject(const char* name); // BLOCKING, allocates a new capability (means App must reserve its cap slots)
 size_t Storage_ObjectSize(cap_t handle); // BLOCKING
+
+typedef enum Storage_MapOptsE {
+    Storage_MapSequential = 1, // read-ahead aggressively, drop pages behind
+    Storage_MapRandom     = 2, // no read-ahead
+    Storage_MapWillNeed   = 4, // start paging the whole object in now
+} Storage_MapOpts;
+
+// Maps the object read-only as a buffer capability (Buffer_Address/Buffer_Size);
+// pages load on first touch and are shared through the page cache.
+// System_DropCapability unmaps it.
+cap_t Storage_MapObject(const char* name, Storage_MapOpts opts); // BLOCKING, allocates a new capability
 int Storage_CopyToMemory (cap_t handle, void* address, size_t ofs, size_t len); // BLOCKING
+
+// Async reads: the batch is copied and read on runtime I/O threads; when every
+// request is done a Storage_ReadDone event (h.cap = st_cap) is posted to queue_cap.
+typedef struct Storage_ReadRequestE {
+    cap_t handle;    // from Storage_FindObject
+    size_t ofs;
+    size_t len;
+    void* address;   // must stay valid until Storage_ReadDone
+} Storage_ReadRequest;
+
+typedef enum Storage_EventE {
+    Storage_ReadDone = 0,
+    Storage_WriteDone = 1,
+} Storage_Event;
+
+typedef struct Storage_ReadDoneEventE {
+    MasqEventHeader h;
+    size_t tag;      // as passed to Storage_ReadAsync
+    uint32_t count;  // requests in the batch
+    uint32_t failed; // requests that hit an error or early EOF
+    size_t bytes;    // bytes read by the successful requests
+} Storage_ReadDoneEvent;
+
+int Storage_ReadAsync(cap_t st_cap, const Storage_ReadRequest* reqs, size_t count, cap_t queue_cap, size_t tag); // returns 0 if queued
+
+// Opens the objects and starts reading them into the page cache on runtime
+// threads, so a later FindObject/MapObject and reads are fast. No event.
+int Storage_Prefetch(const char* const* names, size_t count); // returns 0 if queued
+
+// Streaming writes: Append copies each chunk and returns; a runtime thread
+// writes them behind the App. Commit atomically replaces 'name' (via a
+// '<name>.tmp' file) and posts Storage_WriteDone (h.cap = w_cap) to queue_cap.
+// Commit and Abort both retire w_cap.
+typedef struct Storage_WriteDoneEventE {
+    MasqEventHeader h;
+    size_t tag;      // as passed to Storage_CommitWriter
+    int32_t error;   // 0 on success, else an errno value (the object is unchanged)
+    size_t bytes;    // bytes written
+} Storage_WriteDoneEvent;
+
+cap_t Storage_OpenWriter(const char* name, size_t size_hint); // allocates a new capability; size_hint preallocates (0 = unknown)
+int Storage_Append(cap_t w_cap, const void* data, size_t len);
+int Storage_CommitWriter(cap_t w_cap, cap_t queue_cap, size_t tag);
+int Storage_AbortWriter(cap_t w_cap);
 int Storage_CreateObject(const char* name, cap_t buf_cap, size_t size); // BLOCKING
 int Storage_DeleteObject(const char* name); // BLOCKING
 
@@ -21,8 +76,11 @@ typedef enum FrameBuffer_OptsE {
     FrameBuffer_SendSync     = 4,  // require Sync events at end of display frame
     FrameBuffer_DynamicSize  = 8,  // host can resize the framebuffer (e.g. in a window; single-buffer sends a new Frame)
     FrameBuffer_NoScaleUp    = 16, // avoid scaling up the content (and create window at the requested size)
-    FrameBuffer_NoSmooth     = 32, // use nearest-neighbour scaling or similar; prefer integer size multiples
+    FrameBuffer_NoSmooth     = 32, // use nearest-neighbour scaling or similar; prefer integer size multiples (uploads at native size)
     FrameBuffer_Fullscreen   = 64, // set this to make the framebuffer fullscreen
+    FrameBuffer_TripleBuffer = 128, // like DoubleBuffer, with a third buffer in flight
+    FrameBuffer_AsyncPresent = 256, // convert and present on a runtime thread; Submit never waits for vsync
+    FrameBuffer_Headless     = 512, // no window: convert into memory (also forced by QRT_HEADLESS=1 or no display)
 } FrameBuffer_Opts;
 
 typedef enum FrameBuffer_EventE {
@@ -44,6 +102,8 @@ typedef struct FrameBuffer_FrameEventE {
     // Buffer for the next frame.
     // TRANSFER from FrameBuffer device to this App (do we need to accept and map?)
     // That isn't ideal; it would involve another syscall just after queue read.
+    // With Double/TripleBuffer this rotates between buffers the runtime is not
+    // reading; the App owns it until it is passed to Submit.
     cap_t buf_cap;
 } FrameBuffer_FrameEvent;
 
@@ -52,6 +112,16 @@ typedef struct FrameBuffer_SyncEventE {
     size_t dt_ms;
 } FrameBuffer_SyncEvent;
 
+typedef struct FrameBuffer_StatsE {
+    uint64_t frames;          // frames submitted
+    uint64_t pixels;          // texture pixels covered by those frames
+    uint64_t pixels_uploaded; // texture pixels actually re-converted and uploaded
+    uint64_t convert_us;      // time spent converting and uploading
+    uint64_t latency_us;      // total time from Submit to the end of the present
+    uint32_t latency_last_us; // for the most recent frame
+    uint32_t latency_max_us;
+} FrameBuffer_Stats;
+
 // The display can be Created again to change configuration; should be a seamless transition.
 // Palette changes may apply immediately, or may apply on the next frame submission (if double-buffered)
 
@@ -83,37 +153,70 @@ void FrameBuffer_Create(cap_t fb_cap, FrameBuffer_Opts opts, size_t width, size_
 void FrameBuffer_Configure(cap_t fb_cap, FrameBuffer_Opts opts, size_t width, size_t height, size_t bpp, cap_t queue_cap);
 void FrameBuffer_SetTitle(cap_t fb_cap, const char* title);
 void FrameBuffer_SetFullscreen(cap_t fb_cap, int fullscreen);
+void FrameBuffer_SetScale(cap_t fb_cap, size_t scale); // window size multiple (default 3); pre-scale factor unless NoSmooth/NoScaleUp
+void FrameBuffer_SetWorkers(cap_t fb_cap, size_t workers); // threads converting each frame, including the caller (default 1)
 void FrameBuffer_SetPalette(cap_t fb_cap, cap_t buf_cap); // XXX transfer or share buffer?
 void FrameBuffer_Submit(cap_t fb_cap, cap_t buf_cap); // TRANSFER buffer from Video 'Frame' event
+void FrameBuffer_GetStats(cap_t fb_cap, FrameBuffer_Stats* stats);
+
+// Headless only: receive each converted frame (ARGB8888, valid during the call),
+// and/or write every Nth frame to <path_prefix>NNNNNN.ppm.
+typedef void(*FrameBuffer_CaptureCallback)(void* userdata, const uint32_t* pixels, size_t width, size_t height, size_t pitch_bytes, uint64_t frame);
+void FrameBuffer_SetCapture(cap_t fb_cap, FrameBuffer_CaptureCallback callback, void* userdata);
+void FrameBuffer_SetCaptureDump(cap_t fb_cap, const char* path_prefix, size_t every_n);
 
 
 // AUDIO
 
+// The sample format of an audio cap (Audio_None is S16). Each format is
+// converted to S16 for mixing. Audio_NoFmtConversion is S16 that should
+// already be at the device's rate: as the first cap it opens the device at
+// its own rate, later caps at another rate are resampled like the rest.
 typedef enum Audio_OptsE {
     Audio_None,
     Audio_NoFmtConversion,
     Audio_Fmt_U8,
     Audio_Fmt_S16, // LE
-    Audio_Fmt_S24,
-    Audio_Fmt_S32,
+    Audio_Fmt_S24, // LE, packed in 3 bytes
+    Audio_Fmt_S32, // LE
 } Audio_Opts;
 
+// Resampling, for caps whose rate differs from the device's.
+typedef enum Audio_QualityE {
+    Audio_QualityFast,    // linear interpolation
+    Audio_QualityDefault, // 16-tap windowed sinc
+    Audio_QualityBest,    // 32-tap windowed sinc
+} Audio_Quality;
+
 // AC97: mono, stereo, 16-bit
 // AC97: 8, 11.025, 16, 22.05, 32, 44.1, 48 kHz
 // Optional: 18-bit, 20-bit, 4/6 channel, 5.1 S/PDIF
 
+typedef enum Audio_EventE {
+    Audio_Frame, // sent when the device wants more audio (push mode)
+} Audio_Event;
+
 typedef struct Audio_FrameEventE {
     MasqEventHeader h;
-    size_t dt_ms;
-    // Buffer for the next Audio frame.
-    // TRANSFER from Audio device to this App (do we need to accept and map?)
-    // That isn't ideal; it would involve another syscall just after queue read.
+    size_t dt_ms; // audio still queued for the device
+    // A chunk-sized buffer owned by the runtime, which the App may fill and
+    // pass to Audio_Submit (any buffer will do); valid until the next event.
     cap_t buf_cap;
 } Audio_FrameEvent;
 
+// All audio caps are mixed into one device, opened with the spec of the first
+// one; later caps must use its channel count, or mono. Any rate within 8x of
+// the device's is resampled. Audio_FrameCount is the cap's frames per chunk.
+
 // Push Mode
+// Audio_Frame is posted to s_queue while less than the latency target
+// (default: two chunks) is queued. Audio_Submit copies the buffer and never
+// blocks; audio beyond the queue's capacity (8 chunks) is dropped.
+// A push-mode cap starts out playing; Audio_Stop pauses it (submitted audio
+// stays queued) until Audio_Start.
 void Audio_Create(cap_t au_cap, cap_t s_queue, Audio_Opts opts, size_t channels, size_t sample_rate, size_t samples_per_frame);
-void Audio_Submit(cap_t au_cap, cap_t buf_cap); // TRANSFER buffer from Audio 'Frame' event
+void Audio_Submit(cap_t au_cap, cap_t buf_cap);
+void Audio_SetLatency(cap_t au_cap, size_t latency_ms);
 
 // Pull Mode
 typedef void(*Audio_StreamCallback)(void* userdata, uint8_t* buffer, int size_in_bytes);
@@ -121,6 +224,31 @@ void Audio_CreateStream(cap_t au_cap, Audio_StreamCallback callback, Audio_Opts
 size_t Audio_FrameCount(cap_t au_cap);
 void Audio_Start(cap_t au_cap);
 void Audio_Stop(cap_t au_cap);
+void Audio_SetGain(cap_t au_cap, float gain); // 0 .. 8, default 1
+void Audio_SetQuality(cap_t au_cap, Audio_Quality quality);
+
+// Commands into a pull-mode callback. One App thread posts; the callback
+// reads them at the start of its chunk, without locks or allocation.
+// A command with a 'frame' (an Audio_Position, 0 = now) stays queued until
+// the chunk that contains it; it counts as late if read after that chunk.
+typedef struct Audio_CommandE {
+    uint32_t op;       // App-defined
+    uint32_t id;
+    uint64_t frame;
+    float value[2];
+    uint64_t data;
+} Audio_Command;
+
+typedef struct Audio_StatsE {
+    uint64_t commands; // read by the callback
+    uint64_t dropped;  // posted while the channel was full (256 commands)
+    uint64_t late;
+} Audio_Stats;
+
+int Audio_PostCommand(cap_t au_cap, const Audio_Command* cmd); // returns 0 if dropped
+int Audio_ReadCommand(cap_t au_cap, Audio_Command* cmd); // in the callback; returns 0 when done
+uint64_t Audio_Position(cap_t au_cap); // frames the callback has supplied; in the callback, the start of its chunk
+void Audio_GetStats(cap_t au_cap, Audio_Stats* stats);
 
 
 // INPUT
@@ -0,0 +1,103 @@
+#pragma once
+
+// Framebuffer row kernels. Internal to qrt_system.c; a header only so that
+// tests/fb_expand_test.c can check the SIMD kernels against the scalar one.
+
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#ifndef QRT_X86
+#define QRT_X86 1
+#endif
+#endif
+
+// Row kernels: look up each 8-bit source pixel once and write it 'scale'
+// times horizontally. Vertical scaling is done by copying finished rows.
+typedef void (*fb_expand_fn)(uint32_t* to, const uint8_t* from, size_t width, const uint32_t* pal, int scale);
+
+static void fb_expand_row_c(uint32_t* to, const uint8_t* from, size_t width, const uint32_t* pal, int scale) {
+    switch (scale) {
+        case 1:
+            for (size_t x=0; x<width; x++) to[x] = pal[from[x]];
+            return;
+        case 2:
+            for (size_t x=0; x<width; x++, to+=2) to[0] = to[1] = pal[from[x]];
+            return;
+        case 3:
+            for (size_t x=0; x<width; x++, to+=3) to[0] = to[1] = to[2] = pal[from[x]];
+            return;
+        default:
+            for (size_t x=0; x<width; x++) {
+                uint32_t c = pal[from[x]];
+                for (int i=0; i<scale; i++) *to++ = c;
+            }
+    }
+}
+
+#ifdef QRT_X86
+
+__attribute__((target("sse2")))
+static void fb_expand_row_sse2(uint32_t* to, const uint8_t* from, size_t width, const uint32_t* pal, int scale) {
+    if (scale < 1 || scale > 4) {
+        fb_expand_row_c(to, from, width, pal, scale);
+        return;
+    }
+    __m128i* out = (__m128i*) to;
+    size_t x = 0;
+    for (; x+4 <= width; x+=4) {
+        __m128i v = _mm_set_epi32(pal[from[x+3]], pal[from[x+2]], pal[from[x+1]], pal[from[x]]);
+        switch (scale) {
+            case 1:
+                _mm_storeu_si128(out++, v);
+                break;
+            case 2:
+                _mm_storeu_si128(out++, _mm_unpacklo_epi32(v, v)); // 0 0 1 1
+                _mm_storeu_si128(out++, _mm_unpackhi_epi32(v, v)); // 2 2 3 3
+                break;
+            case 3:
+                _mm_storeu_si128(out++, _mm_shuffle_epi32(v, 0x40)); // 0 0 0 1
+                _mm_storeu_si128(out++, _mm_shuffle_epi32(v, 0xA5)); // 1 1 2 2
+                _mm_storeu_si128(out++, _mm_shuffle_epi32(v, 0xFE)); // 2 3 3 3
+                break;
+            case 4:
+                _mm_storeu_si128(out++, _mm_shuffle_epi32(v, 0x00));
+                _mm_storeu_si128(out++, _mm_shuffle_epi32(v, 0x55));
+                _mm_storeu_si128(out++, _mm_shuffle_epi32(v, 0xAA));
+                _mm_storeu_si128(out++, _mm_shuffle_epi32(v, 0xFF));
+                break;
+        }
+    }
+    fb_expand_row_c(to + x*scale, from + x, width - x, pal, scale);
+}
+
+__attribute__((target("avx2")))
+static void fb_expand_row_avx2(uint32_t* to, const uint8_t* from, size_t width, const uint32_t* pal, int scale) {
+    if (scale < 1 || scale > 4) {
+        fb_expand_row_c(to, from, width, pal, scale);
+        return;
+    }
+    // output lane -> source lane, for each group of 8 output pixels.
+    static const int32_t lanes[4][4][8] = {
+        {{0,1,2,3,4,5,6,7}},
+        {{0,0,1,1,2,2,3,3}, {4,4,5,5,6,6,7,7}},
+        {{0,0,0,1,1,1,2,2}, {2,3,3,3,4,4,4,5}, {5,5,6,6,6,7,7,7}},
+        {{0,0,0,0,1,1,1,1}, {2,2,2,2,3,3,3,3}, {4,4,4,4,5,5,5,5}, {6,6,6,6,7,7,7,7}},
+    };
+    __m256i perm[4];
+    for (int i=0; i<scale; i++) {
+        perm[i] = _mm256_loadu_si256((const __m256i*) lanes[scale-1][i]);
+    }
+    __m256i* out = (__m256i*) to;
+    size_t x = 0;
+    for (; x+8 <= width; x+=8) {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(from + x)));
+        __m256i v = _mm256_i32gather_epi32((const int*) pal, idx, 4);
+        for (int i=0; i<scale; i++) {
+            _mm256_storeu_si256(out++, _mm256_permutevar8x32_epi32(v, perm[i]));
+        }
+    }
+    fb_expand_row_c(to + x*scale, from + x, width - x, pal, scale);
+}
+
+#endif
@@ -1,58 +1,207 @@
 #include "platform.h"
+#include "qrt_fb_expand.h"
 
 #include <SDL.h>
 
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QRT_X86 1
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <linux/memfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+enum cap_kindE {
+    CAP_KIND_HEAP = 0,  // malloc'd buffer (or no buffer)
+    CAP_KIND_POOL,      // size-class pool block
+    CAP_KIND_MAPPED,    // anonymous mapping; can host Buffer_MapShared pages
+    CAP_KIND_SHARED,    // memfd mapping; 'fd' names the pages
+    CAP_KIND_FILE,      // read-only mapping of a storage object
+    CAP_KIND_WRITER,    // Storage_OpenWriter state (not a buffer)
+    CAP_KIND_AUDIO,     // push-mode audio state (not a buffer)
+};
 
 typedef struct capinfoE {
     void* buf;
     size_t size;
     int fd;
-    uint32_t aud;
+    uint8_t kind;
+    _Atomic uint32_t gen;        // generation of the live handle (0: App-named)
+    _Atomic uint32_t next_free;  // free list link (index)
 } capinfo;
 
-static capinfo caps[1000] = {0};
-static int next_cap = 100;
+// A cap_t is a table index in the low CAP_INDEX_BITS and a generation above.
+// Apps name their own caps below CAP_FIRST_DYNAMIC with generation 0; the
+// runtime allocates the rest, and bumps the generation when one is dropped so
+// stale handles stop resolving. The table is a reserved address range that is
+// committed as it is touched, so entries never move and lookup is one load.
+// The generation wraps at 8 bits so every handle fits the 32-bit
+// MasqEventHeader.cap; a stale copy only resolves again after 255 reuses.
+#define CAP_INDEX_BITS 24
+#define CAP_INDEX_MASK (((cap_t)1 << CAP_INDEX_BITS) - 1)
+#define CAP_GEN(cap) ((uint32_t)((cap) >> CAP_INDEX_BITS))
+#define CAP_GEN_MASK ((uint32_t)(UINT32_MAX >> CAP_INDEX_BITS))
+#define CAP_FIRST_DYNAMIC 100
+#define CAP_FALLBACK_SLOTS 4096 // if the address space can't be reserved
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+static capinfo caps_static[CAP_FALLBACK_SLOTS] = {0}; // used until System_Init
+static capinfo* caps = caps_static;
+static uint32_t cap_limit = CAP_FALLBACK_SLOTS;
+static _Atomic uint32_t cap_next = CAP_FIRST_DYNAMIC; // never-used slots start here
+static _Atomic uint64_t cap_free = 0;   // free list head: ABA tag << 32 | index
 
 static SDL_mutex* qrt_main_mutex = 0;
+static int qrt_headless = 0; // no display: QRT_HEADLESS is set, or video failed to init
+static SDL_cond* qrt_park_cond = 0;
 static uint32_t qrt_main_thread_id = 0;
 
 static uint32_t user_sdl_events = 0;
 enum user_eventsE {
     uev_fb_frame = 0,
+    uev_wake = 1,     // another thread posted into the service queue
+    uev_count,
 } user_events;
 
 static int fb_fullscreen = 0;
 static uint32_t fb_cap = 0;
 static uint32_t fb_width = 0;
 static uint32_t fb_height = 0;
-static uint32_t fb_disp_width = 0;
+static uint32_t fb_disp_width = 0;  // texture size
 static uint32_t fb_disp_height = 0;
-static cap_t fb_buffer = 0;
+static uint32_t fb_scale = 3;       // window size multiple (FrameBuffer_SetScale)
+static uint32_t fb_tex_scale = 3;   // CPU pre-scale into the texture (1 = native upload)
+static FrameBuffer_Opts fb_opts = 0;
 static SDL_Window* window = 0;
 static SDL_Renderer* renderer = 0;
 static SDL_Texture* texture = 0;
+static uint32_t* fb_surface = 0; // headless: CPU-side texture (fb_disp_width pitch)
+static int fb_headless = 0;       // the current framebuffer converts into fb_surface
+static FrameBuffer_CaptureCallback fb_capture_fn = 0;
+static void* fb_capture_data = 0;
+static char fb_dump_prefix[256] = {0};
+static size_t fb_dump_every = 0;
 static uint32_t palette[256] = {0};
-
-static cap_t snd_queue = 0;
-static SDL_AudioDeviceID snd_device = 0;
-static int snd_playing = 0;
-
-static SDL_Event event;
+static uint32_t* fb_row = 0; // one expanded row, copied fb_tex_scale times
+static uint8_t* fb_prev = 0; // copy of the pixels currently in the texture
+static int fb_full_refresh = 1; // texture contents are stale (palette, new texture)
+// FrameBuffer_Stats, updated by whichever thread converts and presents and
+// read by FrameBuffer_GetStats from any other: relaxed atomics, so no
+// counter is torn, though the fields are not one snapshot.
+static struct {
+    _Atomic uint64_t frames, pixels, pixels_uploaded, convert_us, latency_us;
+    _Atomic uint32_t latency_last_us, latency_max_us;
+} fb_stats;
+
+#define fb_stat_add(field, n) atomic_fetch_add_explicit(&fb_stats.field, (n), memory_order_relaxed)
+#define fb_stat_get(field) atomic_load_explicit(&fb_stats.field, memory_order_relaxed)
+
+static SDL_AudioDeviceID snd_device = 0; // shared by all audio caps (mixed)
 
 static uint16_t ptr_btns = 0;
 static int ptr_relative = 0;
 
-static FrameBuffer_FrameEvent fb_frame;
-static Input_KeyEvent key_event;
-static Input_PointerEvent ptr_event;
-static MasqEvent gen_event;
+
+static void fb_stop_present(void);
+static void audio_drop(void* audio);
+static void qrt_futex_wait(_Atomic uint32_t* addr, uint32_t val, int timeout_ms);
+static void qrt_futex_wake(_Atomic uint32_t* addr, int n);
+static size_t buffer_map_len(size_t size);
+
+
+// CAPABILITIES
+
+static inline capinfo* qrt_cap(cap_t cap) {
+    return &caps[cap & CAP_INDEX_MASK];
+}
+
+// The slot for 'cap', or 0 if the handle is stale.
+static inline capinfo* qrt_cap_live(cap_t cap) {
+    capinfo* c = &caps[cap & CAP_INDEX_MASK];
+    return atomic_load_explicit(&c->gen, memory_order_relaxed) == CAP_GEN(cap) ? c : 0;
+}
+
+static void qrt_caps_reserve(void) {
+    size_t slots = (size_t)CAP_INDEX_MASK + 1;
+    void* mem = mmap(0, slots * sizeof(capinfo), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        printf("[RT] mmap (cap table): %s; limited to %d caps\n", strerror(errno), CAP_FALLBACK_SLOTS);
+        return;
+    }
+    // no runtime threads exist yet, so the static table can be moved once.
+    memcpy(mem, caps_static, sizeof(caps_static));
+    caps = mem;
+    cap_limit = (uint32_t) slots;
+}
+
+// Allocate a runtime cap (lock-free); 0 if the table is full.
+static cap_t qrt_cap_alloc(void) {
+    uint64_t head = atomic_load_explicit(&cap_free, memory_order_acquire);
+    while ((uint32_t) head) {
+        uint32_t idx = (uint32_t) head;
+        uint32_t next = atomic_load_explicit(&caps[idx].next_free, memory_order_relaxed);
+        uint64_t want = (((head >> 32) + 1) << 32) | next; // bump the tag against ABA
+        if (atomic_compare_exchange_weak_explicit(&cap_free, &head, want, memory_order_acquire, memory_order_acquire)) {
+            return ((cap_t) atomic_load_explicit(&caps[idx].gen, memory_order_relaxed) << CAP_INDEX_BITS) | idx;
+        }
+    }
+    uint32_t idx = atomic_fetch_add(&cap_next, 1);
+    if (idx >= cap_limit) {
+        atomic_store(&cap_next, cap_limit);
+        printf("[RT] capability table full (%u)\n", cap_limit);
+        return 0;
+    }
+    atomic_store_explicit(&caps[idx].gen, 1, memory_order_relaxed);
+    return ((cap_t) 1 << CAP_INDEX_BITS) | idx;
+}
+
+static void qrt_cap_clear(capinfo* c) {
+    c->buf = 0;
+    c->size = 0;
+    c->fd = 0;
+    c->kind = CAP_KIND_HEAP;
+}
+
+// Retire a cap whose resources are already freed: the slot is cleared, and
+// for a runtime cap stale copies of the handle stop resolving.
+static void qrt_cap_release(cap_t cap) {
+    uint32_t idx = cap & CAP_INDEX_MASK;
+    uint32_t gen = CAP_GEN(cap);
+    capinfo* c = &caps[idx];
+    if (idx < CAP_FIRST_DYNAMIC || !gen) { // App-named: the name stays usable
+        qrt_cap_clear(c);
+        return;
+    }
+    uint32_t next_gen = (gen + 1) & CAP_GEN_MASK;
+    if (!next_gen) next_gen = 1;
+    if (!atomic_compare_exchange_strong(&c->gen, &gen, next_gen)) return; // already dropped
+    qrt_cap_clear(c);
+    uint64_t head = atomic_load_explicit(&cap_free, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&c->next_free, (uint32_t) head, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&cap_free, &head, (((head >> 32) + 1) << 32) | idx, memory_order_release, memory_order_relaxed));
+}
+
 
 static void masq_sdl_exit(void) {
+    fb_stop_present();
     if (snd_device) {
-        SDL_CloseAudio();
+        SDL_CloseAudioDevice(snd_device);
         snd_device = 0;
     }
     SDL_Quit();
@@ -62,25 +211,54 @@ static void masq_sdl_exit(void) {
 // SYSTEM
 
 void System_Init(void) {
-    if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_AUDIO|SDL_INIT_EVENTS) < 0) {
+    qrt_caps_reserve();
+    const char* headless = getenv("QRT_HEADLESS");
+    if (headless && *headless && strcmp(headless, "0")) qrt_headless = 1;
+    // subsystems are started separately so a GPU-less box still gets events.
+    if (SDL_Init(SDL_INIT_EVENTS) < 0) {
         printf("[RT] SDL_Init: %s\n", SDL_GetError());
     }
+    if (!qrt_headless && SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) {
+        printf("[RT] SDL_InitSubSystem (video): %s; running headless\n", SDL_GetError());
+        qrt_headless = 1;
+    }
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+        printf("[RT] SDL_InitSubSystem (audio): %s\n", SDL_GetError());
+    }
     // SDL_SetHint(SDL_HINT_MOUSE_RELATIVE_MODE_WARP, "1");
-    user_sdl_events = SDL_RegisterEvents(1);
+    user_sdl_events = SDL_RegisterEvents(uev_count);
     qrt_main_mutex = SDL_CreateMutex();
+    qrt_park_cond = SDL_CreateCond();
     qrt_main_thread_id = SDL_ThreadID();
     atexit(masq_sdl_exit);
 }
 
 void System_DropCapability(cap_t cap) {
-    if (caps[cap].fd) {
-        close(caps[cap].fd);
-        caps[cap].fd = 0;
+    capinfo* c = qrt_cap_live(cap);
+    if (!c) return; // stale
+    switch (c->kind) {
+    case CAP_KIND_HEAP:
+    case CAP_KIND_POOL:
+    case CAP_KIND_MAPPED:
+    case CAP_KIND_SHARED:
+    case CAP_KIND_FILE:
+        // free, return to the pool or unmap (with any Buffer_MapShared pages).
+        Buffer_Destroy(cap);
+        break;
+    case CAP_KIND_WRITER:
+        // the writer thread closes and unlinks '.tmp'; this releases the cap.
+        Storage_AbortWriter(cap);
+        return;
+    case CAP_KIND_AUDIO:
+        audio_drop(c->buf);
+        c->buf = 0;
+        break;
     }
-    if (caps[cap].aud) {
-        SDL_CloseAudioDevice(caps[cap].aud);
-        caps[cap].aud = 0;
+    if (c->fd) { // Storage_FindObject handle
+        close(c->fd);
+        c->fd = 0;
     }
+    qrt_cap_release(cap);
 }
 
 void System_OfferCapability(cap_t cap, cap_t recipient) {
@@ -92,139 +270,1215 @@ void System_AcceptCapability(cap_t sender, size_t token, void* io_address, size_
 
 // TASKS
 
-// Queue a new task in the scheduler.
-void Task_Create(int (*fn)(void* args), void* args) {
-    // hacks, no scheduler yet.
-    // XXX returning 'int' for SDL compatibility.
-    if (!SDL_CreateThread(fn, "task", args)) {
-        printf("[RT] SDL_CreateThread: %s\n", SDL_GetError());
+// Work-stealing scheduler: one worker per core, each with a Chase-Lev
+// deque of task slot indices. Workers push and pop their own deque at the
+// bottom and steal from the top of others'; tasks created on other threads
+// go through a shared injection queue. Idle workers sleep on a futex.
+// A task_t is a slot index and the slot's generation, which is bumped when
+// the task finishes, so finished slots are reused without any release call.
+// A task that blocks in a syscall (rather than a parking runtime wait) holds
+// its worker; when queued work makes no progress for TASK_STALL_MS with every
+// worker inside a task, a monitor adds a spare worker (no deque, no pinning).
+
+#define TASK_SLOTS 65536        // tasks in flight, in total
+#define TASK_DEQUE_SIZE 4096    // per worker, power of two
+#define TASK_MAX_WORKERS 64
+#define TASK_MAX_THREADS (2 * TASK_MAX_WORKERS) // workers plus spares
+#define TASK_STALL_MS 50
+#define TASK_EMPTY 0xFFFFFFFFu
+#define TASK_ABORT 0xFFFFFFFEu  // lost a steal race
+
+typedef struct qrt_fiberS qrt_fiber;
+
+typedef struct task_slotS {
+    int (*fn)(void* args);
+    void* args;
+    Task_Counter* counter;
+    qrt_fiber* fiber;           // Task_CreateFiber: runs on its own stack
+    _Atomic uint32_t gen;       // generation of the live task
+    _Atomic uint32_t waiters;   // threads in Task_Join
+    _Atomic uint32_t fibers;    // fibers parked in Task_Join (list through wait_next)
+    uint32_t wait_next;         // while this task's fiber is parked on a wait list
+    _Atomic uint32_t next_free;
+} task_slot;
+
+// Fibers parked in Task_WaitCounter. A counter may be freed as soon as it
+// reads 0, so the lists live here, hashed by address; 'epoch' is bumped
+// whenever a counter in the bucket reaches 0.
+#define TASK_COUNTER_WAITS 64 // power of two
+
+typedef struct task_counter_waitS {
+    _Atomic uint32_t epoch;
+    _Atomic uint32_t fibers;
+} task_counter_wait;
+
+// What a parking fiber waits for: the wait is over once *epoch != seen.
+typedef struct task_waitS {
+    _Atomic uint32_t* fibers;
+    _Atomic uint32_t* epoch;
+    uint32_t seen;
+} task_wait;
+
+typedef struct task_dequeS {
+    _Atomic int64_t top;        // thieves
+    uint8_t pad_t[56];
+    _Atomic int64_t bottom;     // owner
+    uint8_t pad_b[56];
+    _Atomic uint32_t ring[TASK_DEQUE_SIZE];
+} task_deque;
+
+static task_slot task_slots[TASK_SLOTS];
+static task_counter_wait task_counter_waits[TASK_COUNTER_WAITS];
+static _Atomic uint32_t task_next = 1; // never-used slots start here (0: no task)
+static _Atomic uint64_t task_free = 0; // free list head: ABA tag << 32 | index
+static task_deque* task_deques = 0;
+static int task_workers = 0;
+static _Atomic int task_ready = 0;
+static SDL_SpinLock task_start = 0;
+static _Thread_local int task_worker_id = -1;
+
+// Progress of each worker and spare, for the stall monitor (owner writes).
+typedef struct task_threadS {
+    _Atomic uint32_t running;   // task_run depth
+    _Atomic uint32_t finished;  // tasks run to the end or to a park
+    uint8_t pad[56];
+} task_thread;
+
+static task_thread task_threads[TASK_MAX_THREADS];
+static _Atomic int task_thread_count = 0;
+static _Thread_local task_thread* task_self = 0;
+#ifdef __linux__
+static int task_cpus[TASK_MAX_WORKERS]; // CPUs the process may run on
+static int task_cpu_count = 0;
+#endif
+
+static SDL_SpinLock task_inject_lock = 0;
+static uint32_t task_inject[TASK_SLOTS]; // ring; can't overflow (one entry per slot)
+static uint32_t task_inject_head = 0;
+static uint32_t task_inject_tail = 0;
+static _Atomic uint32_t task_inject_count = 0;
+
+static _Atomic uint32_t task_epoch = 0;    // futex: bumped when work arrives for sleepers
+static _Atomic uint32_t task_sleepers = 0;
+
+static int task_deque_push(task_deque* d, uint32_t x) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= TASK_DEQUE_SIZE) return 0; // full
+    atomic_store_explicit(&d->ring[b & (TASK_DEQUE_SIZE-1)], x, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release); // publishes the slot too
+    return 1;
+}
+
+static uint32_t task_deque_take(task_deque* d) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    uint32_t x = TASK_EMPTY;
+    if (t <= b) {
+        x = atomic_load_explicit(&d->ring[b & (TASK_DEQUE_SIZE-1)], memory_order_relaxed);
+        if (t == b) {
+            // last one: race the thieves for it.
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+                x = TASK_EMPTY;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
     }
+    return x;
 }
 
+static uint32_t task_deque_steal(task_deque* d) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) return TASK_EMPTY;
+    uint32_t x = atomic_load_explicit(&d->ring[t & (TASK_DEQUE_SIZE-1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return TASK_ABORT;
+    }
+    return x;
+}
 
-// MUTEXES
+static void task_inject_push(uint32_t x) {
+    SDL_AtomicLock(&task_inject_lock);
+    task_inject[task_inject_tail++ & (TASK_SLOTS-1)] = x;
+    atomic_fetch_add_explicit(&task_inject_count, 1, memory_order_relaxed);
+    SDL_AtomicUnlock(&task_inject_lock);
+}
+
+static uint32_t task_inject_pop(void) {
+    if (!atomic_load_explicit(&task_inject_count, memory_order_relaxed)) return TASK_EMPTY;
+    uint32_t x = TASK_EMPTY;
+    SDL_AtomicLock(&task_inject_lock);
+    if (task_inject_head != task_inject_tail) {
+        x = task_inject[task_inject_head++ & (TASK_SLOTS-1)];
+        atomic_fetch_sub_explicit(&task_inject_count, 1, memory_order_relaxed);
+    }
+    SDL_AtomicUnlock(&task_inject_lock);
+    return x;
+}
+
+static uint32_t task_slot_alloc(void) {
+    uint64_t head = atomic_load_explicit(&task_free, memory_order_acquire);
+    while ((uint32_t) head) {
+        uint32_t idx = (uint32_t) head;
+        uint32_t next = atomic_load_explicit(&task_slots[idx].next_free, memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&task_free, &head, (((head >> 32) + 1) << 32) | next, memory_order_acquire, memory_order_acquire)) {
+            return idx;
+        }
+    }
+    uint32_t idx = atomic_load_explicit(&task_next, memory_order_relaxed);
+    while (idx < TASK_SLOTS) {
+        if (atomic_compare_exchange_weak_explicit(&task_next, &idx, idx + 1, memory_order_relaxed, memory_order_relaxed)) {
+            return idx;
+        }
+    }
+    return 0; // all slots in flight
+}
+
+static void task_slot_free(uint32_t idx) {
+    uint64_t head = atomic_load_explicit(&task_free, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&task_slots[idx].next_free, (uint32_t) head, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&task_free, &head, (((head >> 32) + 1) << 32) | idx, memory_order_release, memory_order_relaxed));
+}
+
+// Fibers: a fiber task runs on its own (small) stack, and when it would
+// block (Queue_Wait, a storage read, Join) it switches back to whichever
+// thread resumed it. That thread then runs the fiber's 'park' hook, which
+// arranges for the fiber to be pushed again when it can continue; a fiber
+// is only published once it is fully switched out, so it is never resumed
+// twice. A fiber may continue on a different worker thread.
+
+#define FIBER_STACK_DEFAULT (64 << 10)
+#define FIBER_CACHE 64 // default-size stacks kept for reuse
+
+struct qrt_fiberS {
+    ucontext_t ctx;
+    ucontext_t* return_ctx;     // the resumer's context
+    void* stack;                // mapping, including the guard page
+    size_t stack_size;
+    int (*fn)(void* args);
+    void* args;
+    int finished;
+    void (*park)(void* obj, uint32_t idx); // run by the resumer after a switch out
+    void* park_obj;
+    qrt_fiber* next_free;
+};
+
+static _Thread_local qrt_fiber* task_fiber_current = 0;
+static SDL_SpinLock fiber_cache_lock = 0;
+static qrt_fiber* fiber_cache = 0;
+static int fiber_cache_count = 0;
+
+// Not inlined: after a switch, a caller may be on another thread, and a
+// TLS address computed before the switch would be stale.
+static __attribute__((noinline)) qrt_fiber* task_current_fiber(void) {
+    return task_fiber_current;
+}
+
+static void fiber_entry(void) {
+    qrt_fiber* f = task_current_fiber();
+    f->fn(f->args);
+    f->finished = 1;
+    swapcontext(&f->ctx, f->return_ctx); // never returns
+}
+
+// Kept apart from fiber_new: getcontext returns twice, and a caller whose
+// locals change around it may see them clobbered (-Wclobbered).
+static __attribute__((noinline)) void fiber_start(qrt_fiber* f, int (*fn)(void* args), void* args) {
+    getcontext(&f->ctx);
+    f->ctx.uc_stack.ss_sp = (uint8_t*) f->stack + buffer_map_len(1);
+    f->ctx.uc_stack.ss_size = f->stack_size;
+    f->ctx.uc_link = 0;
+    makecontext(&f->ctx, fiber_entry, 0);
+    f->fn = fn;
+    f->args = args;
+    f->finished = 0;
+    f->park = 0;
+}
+
+static qrt_fiber* fiber_new(int (*fn)(void* args), void* args, size_t stack_size) {
+    qrt_fiber* f = 0;
+    if (stack_size == FIBER_STACK_DEFAULT) {
+        SDL_AtomicLock(&fiber_cache_lock);
+        if ((f = fiber_cache) != 0) {
+            fiber_cache = f->next_free;
+            fiber_cache_count--;
+        }
+        SDL_AtomicUnlock(&fiber_cache_lock);
+    }
+    if (!f) {
+        size_t guard = buffer_map_len(1);
+        stack_size = buffer_map_len(stack_size);
+        void* stack = mmap(0, stack_size + guard, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (stack == MAP_FAILED) {
+            printf("[RT] mmap (fiber stack): %s\n", strerror(errno));
+            return 0;
+        }
+        mprotect(stack, guard, PROT_NONE); // overflow faults instead of corrupting
+        f = calloc(1, sizeof(qrt_fiber));
+        f->stack = stack;
+        f->stack_size = stack_size;
+    }
+    fiber_start(f, fn, args);
+    return f;
+}
+
+static void fiber_free(qrt_fiber* f) {
+    if (f->stack_size == FIBER_STACK_DEFAULT) {
+        SDL_AtomicLock(&fiber_cache_lock);
+        if (fiber_cache_count < FIBER_CACHE) {
+            f->next_free = fiber_cache;
+            fiber_cache = f;
+            fiber_cache_count++;
+            f = 0;
+        }
+        SDL_AtomicUnlock(&fiber_cache_lock);
+        if (!f) return;
+    }
+    munmap(f->stack, f->stack_size + buffer_map_len(1));
+    free(f);
+}
+
+// Switch out of the current fiber; 'park' is then called (on the resumer's
+// stack) with the fiber's slot, and must make sure it is pushed again.
+static void qrt_fiber_park(void (*park)(void* obj, uint32_t idx), void* obj) {
+    qrt_fiber* f = task_current_fiber();
+    f->park = park;
+    f->park_obj = obj;
+    swapcontext(&f->ctx, f->return_ctx);
+}
+
+// Run a fiber until it finishes (returns 1) or parks (returns 0).
+static int task_fiber_resume(qrt_fiber* f, uint32_t idx) {
+    ucontext_t here;
+    qrt_fiber* outer = task_fiber_current;
+    f->return_ctx = &here;
+    task_fiber_current = f;
+    swapcontext(&here, &f->ctx);
+    task_fiber_current = outer;
+    if (f->finished) {
+        fiber_free(f);
+        return 1;
+    }
+    void (*park)(void* obj, uint32_t idx) = f->park;
+    f->park = 0;
+    park(f->park_obj, idx); // may resume elsewhere from here on
+    return 0;
+}
+
+static void task_push(uint32_t idx);
+
+static task_counter_wait* task_counter_wait_of(Task_Counter* counter) {
+    uint32_t h = (uint32_t)((uintptr_t) counter >> 3) * 2654435761u;
+    return &task_counter_waits[h >> 16 & (TASK_COUNTER_WAITS-1)];
+}
+
+// Requeue every fiber on a wait list. The list is taken whole, so each
+// fiber is pushed by exactly one waker.
+static void task_wake_fibers(_Atomic uint32_t* fibers) {
+    uint32_t idx = atomic_exchange_explicit(fibers, 0, memory_order_acquire);
+    while (idx) {
+        uint32_t next = task_slots[idx].wait_next; // before it can run and park again
+        task_push(idx);
+        idx = next;
+    }
+}
+
+// Park hook for Task_Join/Task_WaitCounter: publish the fiber on the wait
+// list, unless the wait ended while it was switching out (same handshake as
+// qrt_queue_park). Wakes may be spurious; the waiter checks again.
+static void task_wait_park(void* obj, uint32_t idx) {
+    task_wait w = *(task_wait*) obj; // lives on the fiber's stack: copy before publishing
+    uint32_t head = atomic_load_explicit(w.fibers, memory_order_relaxed);
+    do {
+        task_slots[idx].wait_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(w.fibers, &head, idx, memory_order_release, memory_order_relaxed));
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(w.epoch, memory_order_relaxed) != w.seen) task_wake_fibers(w.fibers);
+}
+
+static void task_run(uint32_t idx) {
+    task_slot* s = &task_slots[idx];
+    Task_Counter* counter = s->counter;
+    if (s->fiber) {
+        if (!task_fiber_resume(s->fiber, idx)) return; // parked
+        s->fiber = 0;
+    } else {
+        s->fn(s->args);
+    }
+    // retire the handle first: the counter's owner may reuse the counter.
+    atomic_fetch_add_explicit(&s->gen, 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&s->waiters, memory_order_relaxed)) {
+        qrt_futex_wake(&s->gen, INT32_MAX);
+    }
+    if (atomic_load_explicit(&s->fibers, memory_order_relaxed)) {
+        task_wake_fibers(&s->fibers);
+    }
+    task_slot_free(idx);
+    if (counter) {
+        _Atomic uint32_t* pending = (_Atomic uint32_t*) &counter->pending;
+        task_counter_wait* w = task_counter_wait_of(counter);
+        if (atomic_fetch_sub_explicit(pending, 1, memory_order_acq_rel) == 1) {
+            // the counter may be gone once it reads 0, so don't look at it
+            // again; waking an address nobody waits on is harmless.
+            qrt_futex_wake(pending, INT32_MAX);
+            atomic_fetch_add_explicit(&w->epoch, 1, memory_order_release);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load_explicit(&w->fibers, memory_order_relaxed)) {
+                task_wake_fibers(&w->fibers);
+            }
+        }
+    }
+}
+
+// Find one task (own deque, injection queue, then steal) and run it.
+static int task_run_one(void) {
+    int self = task_worker_id;
+    uint32_t x = self >= 0 ? task_deque_take(&task_deques[self]) : TASK_EMPTY;
+    if (x == TASK_EMPTY) x = task_inject_pop();
+    if (x == TASK_EMPTY && task_workers) {
+        static _Thread_local uint32_t seed = 0;
+        if (!seed) seed = (uint32_t)(uintptr_t) &seed | 1;
+        seed = seed * 1103515245u + 12345u;
+        int start = (seed >> 16) % task_workers;
+        for (int i=0; i<task_workers && x == TASK_EMPTY; i++) {
+            int victim = (start + i) % task_workers;
+            if (victim == self) continue;
+            do {
+                x = task_deque_steal(&task_deques[victim]);
+            } while (x == TASK_ABORT);
+        }
+    }
+    if (x == TASK_EMPTY) return 0;
+    task_thread* me = task_self;
+    if (me) atomic_store_explicit(&me->running, atomic_load_explicit(&me->running, memory_order_relaxed) + 1, memory_order_relaxed);
+    task_run(x);
+    if (me) {
+        atomic_store_explicit(&me->running, atomic_load_explicit(&me->running, memory_order_relaxed) - 1, memory_order_relaxed);
+        atomic_store_explicit(&me->finished, atomic_load_explicit(&me->finished, memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+    return 1;
+}
+
+static int task_has_work(void) {
+    if (atomic_load_explicit(&task_inject_count, memory_order_relaxed)) return 1;
+    for (int i=0; i<task_workers; i++) {
+        task_deque* d = &task_deques[i];
+        if (atomic_load_explicit(&d->bottom, memory_order_relaxed) > atomic_load_explicit(&d->top, memory_order_relaxed)) return 1;
+    }
+    return 0;
+}
 
-void Mutex_Init(mutex_t* mu) {
-    mu->m = (void*) SDL_CreateMutex();
-    if (mu->m == NULL) {
-        printf("fatal: SDL_CreateMutex failed: %s\n", SDL_GetError());
-        exit(1);
+static int task_worker_main(void* arg) {
+    int id = (int)(uintptr_t) arg;
+    task_self = &task_threads[id];
+    if (id < task_workers) { // spares own no deque
+        task_worker_id = id;
+#ifdef __linux__
+        // pin to one of the allowed cores (raw syscall: cpu_set_t needs _GNU_SOURCE).
+        if (task_cpu_count) {
+            unsigned long mask[16] = {0};
+            int cpu = task_cpus[id % task_cpu_count];
+            mask[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+            syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+        }
+#endif
+    }
+    for (;;) {
+        if (task_run_one()) continue;
+        // no work: announce we are sleeping, then look once more
+        // (pairs with the fence in task_push).
+        uint32_t epoch = atomic_load_explicit(&task_epoch, memory_order_acquire);
+        atomic_fetch_add_explicit(&task_sleepers, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!task_has_work()) {
+            qrt_futex_wait(&task_epoch, epoch, -1);
+        }
+        atomic_fetch_sub_explicit(&task_sleepers, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+static void task_start_thread(int id) {
+    SDL_Thread* t = SDL_CreateThread(task_worker_main, "task-worker", (void*)(uintptr_t) id);
+    if (!t) {
+        printf("[RT] SDL_CreateThread: %s\n", SDL_GetError());
+        return;
     }
+    SDL_DetachThread(t);
 }
 
-void Mutex_Lock(mutex_t* mu) {
-    if (SDL_LockMutex((SDL_mutex*)(mu->m)) < 0) {
-        printf("fatal: SDL_LockMutex failed: %s\n", SDL_GetError());
-        exit(1);
+// Add a spare worker when work is queued but every thread has been inside
+// the same task for a whole period (blocked, or a very long task).
+static int task_monitor_main(void* unused) {
+    uint32_t seen[TASK_MAX_THREADS] = {0};
+    for (;;) {
+        SDL_Delay(TASK_STALL_MS);
+        int count = atomic_load(&task_thread_count);
+        int stalled = task_has_work();
+        for (int i=0; i<count; i++) {
+            uint32_t finished = atomic_load_explicit(&task_threads[i].finished, memory_order_relaxed);
+            if (!atomic_load_explicit(&task_threads[i].running, memory_order_relaxed) || finished != seen[i]) stalled = 0;
+            seen[i] = finished;
+        }
+        if (stalled && count < TASK_MAX_THREADS) {
+            atomic_store(&task_thread_count, count + 1);
+            task_start_thread(count);
+        }
     }
+    return 0;
 }
 
-void Mutex_Unlock(mutex_t* mu) {
-    if (SDL_UnlockMutex((SDL_mutex*)(mu->m)) < 0) {
-        printf("fatal: SDL_UnlockMutex failed: %s\n", SDL_GetError());
-        exit(1);
+static int task_init(void) {
+    SDL_AtomicLock(&task_start);
+    if (!atomic_load(&task_ready)) {
+        int n = SDL_GetCPUCount();
+#ifdef __linux__
+        // one worker per CPU of the process's cpuset, not per CPU of the box.
+        unsigned long mask[16] = {0};
+        long bytes = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+        for (int cpu=0; cpu < bytes * 8 && task_cpu_count < TASK_MAX_WORKERS; cpu++) {
+            if (mask[cpu / (8 * sizeof(unsigned long))] >> (cpu % (8 * sizeof(unsigned long))) & 1) {
+                task_cpus[task_cpu_count++] = cpu;
+            }
+        }
+        if (task_cpu_count && n > task_cpu_count) n = task_cpu_count;
+#endif
+        if (n < 1) n = 1;
+        if (n > TASK_MAX_WORKERS) n = TASK_MAX_WORKERS;
+        task_deques = aligned_alloc(64, n * sizeof(task_deque));
+        memset(task_deques, 0, n * sizeof(task_deque));
+        task_workers = n;
+        atomic_store(&task_thread_count, n);
+        for (int i=0; i<n; i++) {
+            task_start_thread(i);
+        }
+        SDL_Thread* t = SDL_CreateThread(task_monitor_main, "task-monitor", NULL);
+        if (t) SDL_DetachThread(t);
+        atomic_store(&task_ready, 1);
     }
+    SDL_AtomicUnlock(&task_start);
+    return 1;
 }
 
+static void task_push(uint32_t idx) {
+    int self = task_worker_id;
+    if (self < 0 || !task_deque_push(&task_deques[self], idx)) {
+        task_inject_push(idx);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&task_sleepers, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&task_epoch, 1, memory_order_release);
+        qrt_futex_wake(&task_epoch, 1);
+    }
+}
 
-// ATOMICS
+// Queue a new task in the scheduler.
+static task_t task_create(Task_Counter* counter, int (*fn)(void* args), void* args, size_t fiber_stack) {
+    if (!atomic_load_explicit(&task_ready, memory_order_acquire)) task_init();
+    uint32_t idx = task_slot_alloc();
+    qrt_fiber* f = 0;
+    if (idx && fiber_stack && !(f = fiber_new(fn, args, fiber_stack))) {
+        task_slot_free(idx);
+        idx = 0;
+    }
+    if (!idx) {
+        fn(args); // every slot is in flight: run it here
+        return 0;
+    }
+    task_slot* s = &task_slots[idx];
+    s->fn = fn;
+    s->args = args;
+    s->counter = counter;
+    s->fiber = f;
+    if (counter) {
+        atomic_fetch_add_explicit((_Atomic uint32_t*) &counter->pending, 1, memory_order_relaxed);
+    }
+    task_t task = ((task_t) atomic_load_explicit(&s->gen, memory_order_relaxed) << 32) | idx;
+    task_push(idx);
+    return task;
+}
 
-// Yeah they're just wrapped, not sure how atomics will play out yet.
+task_t Task_CreateCounted(Task_Counter* counter, int (*fn)(void* args), void* args) {
+    return task_create(counter, fn, args, 0);
+}
 
-void Atomic_Set_Int(Atomic_Int* var, int value) {
-        // "This function also acts as a full memory barrier"
-        SDL_AtomicSet((SDL_atomic_t*)var, value);
+task_t Task_Create(int (*fn)(void* args), void* args) {
+    return task_create(0, fn, args, 0);
 }
-int Atomic_Get_Int(Atomic_Int* var) {
-        return SDL_AtomicGet((SDL_atomic_t*)var);
+
+task_t Task_CreateFiber(Task_Counter* counter, int (*fn)(void* args), void* args, size_t stack_size) {
+    return task_create(counter, fn, args, stack_size ? stack_size : FIBER_STACK_DEFAULT);
 }
-int Atomic_CAS_Int(Atomic_Int* var, int old_val, int new_val) {
-        return SDL_AtomicCAS((SDL_atomic_t*)var, old_val, new_val);
+
+void Task_Join(task_t task) {
+    uint32_t idx = (uint32_t) task;
+    if (!idx || idx >= TASK_SLOTS) return;
+    task_slot* s = &task_slots[idx];
+    uint32_t gen = (uint32_t)(task >> 32);
+    while (atomic_load_explicit(&s->gen, memory_order_acquire) == gen) {
+        if (task_current_fiber()) {
+            // don't run other tasks on a small stack: park until task_run retires it.
+            task_wait w = { &s->fibers, &s->gen, gen };
+            qrt_fiber_park(task_wait_park, &w);
+            continue;
+        }
+        if (task_run_one()) continue; // help while waiting
+        atomic_fetch_add_explicit(&s->waiters, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        // time out now and then to help with tasks queued meanwhile.
+        qrt_futex_wait(&s->gen, gen, 1);
+        atomic_fetch_sub_explicit(&s->waiters, 1, memory_order_relaxed);
+    }
 }
 
-void Atomic_Set_Ptr(Atomic_Ptr* var, void* ptr) {
-        // "This function also acts as a full memory barrier"
-        SDL_AtomicSetPtr(&var->ptr, ptr);
+void Task_WaitCounter(Task_Counter* counter) {
+    _Atomic uint32_t* pending = (_Atomic uint32_t*) &counter->pending;
+    uint32_t n;
+    while ((n = atomic_load_explicit(pending, memory_order_acquire)) != 0) {
+        if (task_current_fiber()) {
+            // read the epoch before the final check, so a 0 reached
+            // after it still wakes us.
+            task_counter_wait* cw = task_counter_wait_of(counter);
+            task_wait w = { &cw->fibers, &cw->epoch, atomic_load_explicit(&cw->epoch, memory_order_acquire) };
+            if (!atomic_load_explicit(pending, memory_order_acquire)) break;
+            qrt_fiber_park(task_wait_park, &w);
+            continue;
+        }
+        if (task_run_one()) continue;
+        // time out now and then to help with tasks queued meanwhile.
+        qrt_futex_wait(pending, n, 1);
+    }
 }
-void Atomic_Set_Ptr_Release(Atomic_Ptr* var, void* ptr) {
-        // "insert a release barrier between writing the data and the flag"
-        SDL_MemoryBarrierReleaseFunction();
-        // (makes no claim about barriers:)
-        SDL_AtomicSetPtr(&var->ptr, ptr);
+
+// The old Task_Create: a dedicated thread, for tasks that loop or block for good.
+void Task_CreateThread(int (*fn)(void* args), void* args) {
+    // XXX returning 'int' for SDL compatibility.
+    SDL_Thread* t = SDL_CreateThread(fn, "task", args);
+    if (!t) {
+        printf("[RT] SDL_CreateThread: %s\n", SDL_GetError());
+        return;
+    }
+    SDL_DetachThread(t);
 }
-void* Atomic_Get_Ptr(Atomic_Ptr* var) {
-        return SDL_AtomicGetPtr(&var->ptr);
+
+
+// MUTEXES
+
+#define MUTEX_SPIN 100 // lock attempts before sleeping
+
+void Mutex_LockSlow(mutex_t* mu) {
+    // spin while the holder is running; once others sleep, queue behind them.
+    for (int i = 0; i < MUTEX_SPIN; i++) {
+        uint32_t s = atomic_load_explicit(&mu->state, memory_order_relaxed);
+        if (s == 2) break;
+        if (s == 0 && atomic_compare_exchange_weak_explicit(&mu->state, &s, 1,
+                memory_order_acquire, memory_order_relaxed)) {
+            return;
+        }
+#ifdef QRT_X86
+        _mm_pause();
+#endif
+    }
+    // taking it as 2 makes our unlock wake the next sleeper.
+    while (atomic_exchange_explicit(&mu->state, 2, memory_order_acquire) != 0) {
+        qrt_futex_wait(&mu->state, 2, -1);
+    }
 }
-void* Atomic_Get_Ptr_Acquire(Atomic_Ptr* var) {
-        void* p = SDL_AtomicGetPtr(&var->ptr);
-        // (makes no claim about barriers:)
-        SDL_MemoryBarrierAcquireFunction();
-        return p;
+
+void Mutex_UnlockSlow(mutex_t* mu) {
+    qrt_futex_wake(&mu->state, 1);
 }
-int Atomic_CAS_Ptr(Atomic_Ptr* var, void* old_ptr, void* new_ptr) {
-        return SDL_AtomicCASPtr(&var->ptr, old_ptr, new_ptr);
+
+
+// FUTEX
+
+// Sleep while *addr == val, for at most timeout_ms (< 0 waits forever).
+// May return early or spuriously; callers re-check their condition.
+static void qrt_futex_wait(_Atomic uint32_t* addr, uint32_t val, int timeout_ms) {
+#ifdef __linux__
+    struct timespec ts, *tp = NULL;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tp = &ts;
+    }
+    if (syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, val, tp, NULL, 0) == -1) {
+        if (errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+            printf("[RT] futex wait: %d\n", errno);
+        }
+    }
+#else
+    // one shared parking lot; wakers broadcast and sleepers re-check.
+    SDL_LockMutex(qrt_main_mutex);
+    if (atomic_load(addr) == val) {
+        if (timeout_ms < 0) SDL_CondWait(qrt_park_cond, qrt_main_mutex);
+        else SDL_CondWaitTimeout(qrt_park_cond, qrt_main_mutex, timeout_ms);
+    }
+    SDL_UnlockMutex(qrt_main_mutex);
+#endif
 }
 
+static void qrt_futex_wake(_Atomic uint32_t* addr, int n) {
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+    SDL_LockMutex(qrt_main_mutex);
+    SDL_CondBroadcast(qrt_park_cond);
+    SDL_UnlockMutex(qrt_main_mutex);
+#endif
+}
 
 
 // BUFFERS
 
+#define BUFFER_PAGE 4096             // Buffer_CreateShared page unit
+#define BUFFER_MMAP_MIN (64 << 10)   // larger buffers are page-mapped (usable as I/O areas)
+#define BUFFER_HUGE_PAGE (2 << 20)
+
+static size_t qrt_page_size = 0;
+
+// Buffers up to 32 KiB come from power-of-two size classes (64 bytes up),
+// carved from slabs and recycled through free lists; 32-64 KiB are
+// malloc'd and BUFFER_MMAP_MIN and up are page-mapped.
+// Each thread keeps a short list per class, so create/destroy churn
+// normally touches no shared state except the statistics counters.
+
+#define POOL_MIN_SHIFT 6 // 64 bytes: blocks are cache-line aligned
+#define POOL_CLASSES 10  // 64 B .. 32 KiB
+#define POOL_SLAB (256 << 10)
+#define POOL_TCACHE_MAX 32  // blocks per class kept by a thread
+#define POOL_BATCH 8        // blocks moved between a thread and the pool at once
+
+typedef struct pool_blockS {
+    struct pool_blockS* next;
+} pool_block;
+
+typedef struct pool_classS {
+    SDL_SpinLock lock;
+    pool_block* free;
+    uint8_t* bump;       // uncarved part of the current slab
+    uint8_t* bump_end;
+    _Atomic uint64_t allocs;
+    _Atomic uint64_t hits; // served from a free list
+    _Atomic size_t live;
+    _Atomic size_t high_water;
+} pool_class;
+
+typedef struct pool_tcacheS {
+    pool_block* head;
+    uint32_t count;
+    uint32_t fresh; // the last 'fresh' blocks of the list were carved, never used
+} pool_tcache;
+
+static pool_class pool_classes[POOL_CLASSES];
+static _Thread_local pool_tcache pool_tcache_local[POOL_CLASSES];
+static _Thread_local int pool_thread_registered = 0;
+static SDL_TLSID pool_tls = 0;
+static SDL_SpinLock pool_tls_lock = 0;
+
+static int pool_class_of(size_t size) {
+    if (size > ((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))) return -1;
+    int cls = 0;
+    while (((size_t)1 << (POOL_MIN_SHIFT + cls)) < size) cls++;
+    return cls;
+}
+
+// Push 'count' blocks from a thread list back to the pool.
+static void pool_release(int cls, pool_block* first, pool_block* last) {
+    pool_class* pc = &pool_classes[cls];
+    SDL_AtomicLock(&pc->lock);
+    last->next = pc->free;
+    pc->free = first;
+    SDL_AtomicUnlock(&pc->lock);
+}
+
+static void pool_thread_exit(void* unused) {
+    for (int cls=0; cls<POOL_CLASSES; cls++) {
+        pool_tcache* tc = &pool_tcache_local[cls];
+        if (!tc->head) continue;
+        pool_block* last = tc->head;
+        while (last->next) last = last->next;
+        pool_release(cls, tc->head, last);
+        tc->head = 0;
+        tc->count = 0;
+        tc->fresh = 0;
+    }
+}
+
+static void pool_register_thread(void) {
+    // SDL runs the TLS destructor when a runtime thread exits.
+    SDL_AtomicLock(&pool_tls_lock);
+    if (!pool_tls) pool_tls = SDL_TLSCreate();
+    SDL_AtomicUnlock(&pool_tls_lock);
+    SDL_TLSSet(pool_tls, (void*) 1, pool_thread_exit);
+    pool_thread_registered = 1;
+}
+
+// Refill a thread list from the pool's free list, or carve a new slab.
+static void pool_refill(int cls, pool_tcache* tc) {
+    pool_class* pc = &pool_classes[cls];
+    size_t bsize = (size_t)1 << (POOL_MIN_SHIFT + cls);
+    int recycled = 0;
+    SDL_AtomicLock(&pc->lock);
+    while (pc->free && tc->count < POOL_BATCH) {
+        pool_block* b = pc->free;
+        pc->free = b->next;
+        b->next = tc->head;
+        tc->head = b;
+        tc->count++;
+        recycled = 1;
+    }
+    if (!recycled) {
+        if (pc->bump == pc->bump_end) {
+            void* slab = aligned_alloc(64, POOL_SLAB); // never returned: blocks are recycled
+            if (!slab) {
+                SDL_AtomicUnlock(&pc->lock);
+                return;
+            }
+            pc->bump = slab;
+            pc->bump_end = pc->bump + POOL_SLAB;
+        }
+        while (pc->bump < pc->bump_end && tc->count < POOL_BATCH) {
+            pool_block* b = (pool_block*) pc->bump;
+            pc->bump += bsize;
+            b->next = tc->head;
+            tc->head = b;
+            tc->count++;
+            tc->fresh++;
+        }
+    }
+    SDL_AtomicUnlock(&pc->lock);
+}
+
+static void* pool_alloc(int cls) {
+    pool_class* pc = &pool_classes[cls];
+    pool_tcache* tc = &pool_tcache_local[cls];
+    if (!pool_thread_registered) pool_register_thread();
+    if (!tc->head) {
+        pool_refill(cls, tc);
+        if (!tc->head) return 0;
+    }
+    // blocks freed by this thread sit in front of the carved ones, so only
+    // the tail of the list is fresh.
+    int hit = tc->count > tc->fresh;
+    if (!hit) tc->fresh--;
+    pool_block* b = tc->head;
+    tc->head = b->next;
+    tc->count--;
+    size_t bsize = (size_t)1 << (POOL_MIN_SHIFT + cls);
+    atomic_fetch_add_explicit(&pc->allocs, 1, memory_order_relaxed);
+    if (hit) atomic_fetch_add_explicit(&pc->hits, 1, memory_order_relaxed);
+    size_t live = atomic_fetch_add_explicit(&pc->live, bsize, memory_order_relaxed) + bsize;
+    size_t high = atomic_load_explicit(&pc->high_water, memory_order_relaxed);
+    while (live > high && !atomic_compare_exchange_weak_explicit(&pc->high_water, &high, live, memory_order_relaxed, memory_order_relaxed));
+    return b;
+}
+
+static void pool_free(int cls, void* ptr) {
+    pool_class* pc = &pool_classes[cls];
+    pool_tcache* tc = &pool_tcache_local[cls];
+    if (!pool_thread_registered) pool_register_thread();
+    pool_block* b = ptr;
+    b->next = tc->head;
+    tc->head = b;
+    tc->count++;
+    atomic_fetch_sub_explicit(&pc->live, (size_t)1 << (POOL_MIN_SHIFT + cls), memory_order_relaxed);
+    if (tc->count > POOL_TCACHE_MAX) {
+        // hand a batch back so other threads can reuse it.
+        pool_block* first = tc->head;
+        pool_block* last = first;
+        for (int i=1; i<POOL_BATCH; i++) last = last->next;
+        tc->head = last->next;
+        tc->count -= POOL_BATCH;
+        if (tc->fresh > tc->count) tc->fresh = tc->count;
+        pool_release(cls, first, last);
+    }
+}
+
+size_t Buffer_GetPoolStats(Buffer_PoolStats* stats, size_t count) {
+    for (size_t cls=0; cls<POOL_CLASSES && cls<count; cls++) {
+        pool_class* pc = &pool_classes[cls];
+        stats[cls].block_size = (size_t)1 << (POOL_MIN_SHIFT + cls);
+        stats[cls].allocs = atomic_load_explicit(&pc->allocs, memory_order_relaxed);
+        stats[cls].hits = atomic_load_explicit(&pc->hits, memory_order_relaxed);
+        stats[cls].live_bytes = atomic_load_explicit(&pc->live, memory_order_relaxed);
+        stats[cls].high_water_bytes = atomic_load_explicit(&pc->high_water, memory_order_relaxed);
+    }
+    return POOL_CLASSES;
+}
+
+static size_t buffer_map_len(size_t size) {
+    if (!qrt_page_size) qrt_page_size = (size_t) sysconf(_SC_PAGESIZE);
+    return (size + qrt_page_size - 1) & ~(qrt_page_size - 1);
+}
+
 void* Buffer_Create(cap_t cap, size_t size, cap_t io_cap) {
-    caps[cap].buf = malloc(size);
-    caps[cap].size = size;
-    return caps[cap].buf;
+    capinfo* c = qrt_cap_live(cap);
+    if (!c) return 0;
+    if (size >= BUFFER_MMAP_MIN) {
+        void* mem = mmap(0, buffer_map_len(size), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            printf("[RT] mmap (buffer): %s\n", strerror(errno));
+            return 0;
+        }
+        c->buf = mem;
+        c->kind = CAP_KIND_MAPPED;
+    } else if (pool_class_of(size) >= 0) {
+        c->buf = pool_alloc(pool_class_of(size));
+        c->kind = CAP_KIND_POOL;
+    } else {
+        c->buf = malloc(size);
+        c->kind = CAP_KIND_HEAP;
+    }
+    c->size = size;
+    return c->buf;
 }
 
 void* Buffer_Address(cap_t cap) {
-    return caps[cap].buf;
+    capinfo* c = qrt_cap_live(cap);
+    return c ? c->buf : 0;
 }
 
 size_t Buffer_Size(cap_t cap) {
-    return caps[cap].size;
+    capinfo* c = qrt_cap_live(cap);
+    return c ? c->size : 0;
+}
+
+// Shared buffers are memfd pages, so the same pages can be mapped again
+// (Buffer_MapShared) or, later, handed to another process by fd.
+static int buffer_memfd(size_t size) {
+#ifdef __linux__
+    int fd = syscall(SYS_memfd_create, "qrt-shared", MFD_CLOEXEC);
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/qrt-shared-%d-%p", (int) getpid(), (void*) &name);
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd != -1) shm_unlink(name);
+#endif
+    if (fd == -1) {
+        printf("[RT] memfd_create: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, (off_t) size) != 0) {
+        printf("[RT] ftruncate (shared buffer): %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void* Buffer_CreateSharedOpts(cap_t cap, size_t size_pg, Buffer_Opts opts) {
+    capinfo* c = qrt_cap_live(cap);
+    if (!c) return 0;
+    int huge = !!(opts & Buffer_HugePages);
+    size_t size = buffer_map_len(size_pg * BUFFER_PAGE);
+    if (huge) size = (size + BUFFER_HUGE_PAGE - 1) & ~(size_t)(BUFFER_HUGE_PAGE - 1);
+    void* mem = MAP_FAILED;
+    int fd = -1;
+#ifdef MFD_HUGETLB
+    if (huge) {
+        // needs reserved hugetlbfs pages; otherwise fall back to THP below.
+        fd = syscall(SYS_memfd_create, "qrt-shared", MFD_CLOEXEC|MFD_HUGETLB);
+        if (fd != -1 && ftruncate(fd, (off_t) size) == 0) {
+            mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, 0);
+        }
+        if (mem == MAP_FAILED && fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+#endif
+    if (fd == -1) {
+        fd = buffer_memfd(size);
+        if (fd == -1) return 0;
+        mem = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mem == MAP_FAILED) {
+        printf("[RT] mmap (shared buffer): %s\n", strerror(errno));
+        close(fd);
+        return 0;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) madvise(mem, size, MADV_HUGEPAGE); // no-op if already hugetlb
+#endif
+    c->buf = mem;
+    c->size = size;
+    c->fd = fd;
+    c->kind = CAP_KIND_SHARED;
+    return mem;
 }
 
 void* Buffer_CreateShared(cap_t cap, size_t size_pg) {
-    return Buffer_Create(cap, size_pg<<12, 0);
+    return Buffer_CreateSharedOpts(cap, size_pg, 0);
 }
 
+// Map the pages of a shared buffer over io_cap's buffer (its I/O area) at
+// io_area_ofs, replacing what was there; both views see the same memory.
 void Buffer_MapShared(cap_t sb_cap, size_t io_area_ofs, cap_t io_cap) {
+    capinfo* sb = qrt_cap_live(sb_cap);
+    capinfo* io = qrt_cap_live(io_cap);
+    if (!sb || !io || sb->kind != CAP_KIND_SHARED || sb->fd <= 0) {
+        printf("[RT] Buffer_MapShared: %u is not a shared buffer\n", (uint32_t) sb_cap);
+        return;
+    }
+    if (io->kind != CAP_KIND_MAPPED && io->kind != CAP_KIND_SHARED) {
+        printf("[RT] Buffer_MapShared: %u has no mapped I/O area\n", (uint32_t) io_cap);
+        return;
+    }
+    if ((io_area_ofs & (buffer_map_len(1) - 1)) || io_area_ofs + sb->size > buffer_map_len(io->size)) {
+        printf("[RT] Buffer_MapShared: offset %zu is unaligned or out of range\n", io_area_ofs);
+        return;
+    }
+    void* at = (uint8_t*) io->buf + io_area_ofs;
+    if (mmap(at, sb->size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, sb->fd, 0) == MAP_FAILED) {
+        printf("[RT] mmap (MapShared): %s\n", strerror(errno));
+    }
 }
 
 void Buffer_Destroy(cap_t cap) {
-    if (caps[cap].buf) {
-        free(caps[cap].buf);
-        caps[cap].buf = 0;
-        caps[cap].size = 0;
+    capinfo* c = qrt_cap_live(cap);
+    if (c && c->buf) {
+        if (c->kind == CAP_KIND_POOL) {
+            pool_free(pool_class_of(c->size), c->buf);
+        } else if (c->kind == CAP_KIND_HEAP) {
+            free(c->buf);
+        } else if (c->kind == CAP_KIND_WRITER || c->kind == CAP_KIND_AUDIO) {
+            return; // owned by the writer thread until commit, or by the device
+        } else {
+            munmap(c->buf, buffer_map_len(c->size));
+        }
+        if (c->kind == CAP_KIND_SHARED && c->fd > 0) {
+            close(c->fd);
+            c->fd = 0;
+        }
+        c->buf = 0;
+        c->size = 0;
+        c->kind = CAP_KIND_HEAP;
     }
 }
 
 
 // QUEUES
 
+// A queue is a single-producer/single-consumer ring of variable-length event
+// records, each starting with a MasqEventHeader and padded to 8 bytes.
+// 'write' and 'read' are free-running byte counters: the producer owns 'write',
+// the consumer owns 'read', and each publishes its counter with release
+// ordering so the other side can acquire it. No locks are taken.
+
+#define QUEUE_ALIGN(n) (((uint32_t)(n) + 7) & ~(uint32_t)7)
+#define QUEUE_PAD_CAP 0xFFFFFFFEu  // filler record: skip to the start of the ring
+#define QUEUE_PUMP_MAX 64          // SDL events fetched per SDL_PeepEvents call
+#define QUEUE_PUMP_RECORD 32       // upper bound on a translated record
+
 typedef struct qrt_queue_hdrS {
-    SDL_mutex* mutex;    // queue lock (ugh)
-    uint32_t read;       // read pointer within queue area.
-    uint32_t write;      // write pointer within queue area.
-    uint32_t size_mask;  // size bitmask (power of two, minus 1)
+    // producer cache line.
+    _Atomic uint32_t write;  // published write counter.
+    uint32_t reserve;        // end of reserved records (published on commit).
+    uint32_t size_mask;      // size bitmask (power of two, minus 1)
+    SDL_SpinLock post_lock;  // serialises Queue_Post, runtime posts and the pump
+    uint8_t pad_w[48];
+    // consumer cache line.
+    _Atomic uint32_t read;   // consumed read counter.
+    uint32_t pending;        // end of the records returned by Queue_Read.
+    _Atomic uint32_t sleeping; // consumer is (about to be) blocked on 'write'.
+    _Atomic uint32_t fiber;  // task slot of a consumer fiber parked on the queue
+    uint8_t pad_r[48];
 } qrt_queue_hdr;
 
+static cap_t svc_queue = 0; // receives SDL-sourced events (input, frames)
+
 void Queue_New(cap_t cap, size_t io_area_ofs, uint32_t size_pow2) {
     if (size_pow2 < 12) size_pow2 = 12; // minimum 4096
     qrt_queue_hdr* q = Buffer_Create(cap, sizeof(qrt_queue_hdr) + (1 << size_pow2), 0);
-    q->mutex = SDL_CreateMutex();
-    q->read = 0;
-    q->write = 0;
+    memset(q, 0, sizeof(qrt_queue_hdr));
+    atomic_init(&q->write, 0);
+    atomic_init(&q->read, 0);
+    atomic_init(&q->sleeping, 0);
     q->size_mask = (1 << size_pow2)-1;
     return;
 }
 
-static int qwaitn = 0;
+static qrt_queue_hdr* qrt_queue(cap_t cap) {
+    if (!qrt_cap(cap)->buf) {
+        // older Apps read SDL events without creating a queue first.
+        Queue_New(cap, 0, 16);
+        if (!svc_queue) svc_queue = cap;
+    }
+    return qrt_cap(cap)->buf;
+}
+
+static int qrt_is_service_queue(cap_t cap) {
+    // the main thread is the only producer for the service queue,
+    // since SDL events can only be pumped on the main thread.
+    if ((uint32_t)SDL_ThreadID() != qrt_main_thread_id) return 0;
+    // until the App names one (FrameBuffer_Create, Input_Subscribe), the
+    // first queue the main thread reads receives SDL events, as every read
+    // did before there were queues.
+    if (!svc_queue) svc_queue = cap;
+    return cap == svc_queue;
+}
+
+static MasqEventHeader* qrt_queue_reserve(qrt_queue_hdr* q, size_t size) {
+    uint32_t len = QUEUE_ALIGN(size);
+    uint32_t ring = q->size_mask + 1;
+    uint32_t pos = q->reserve & q->size_mask;
+    uint32_t skip = (ring - pos < len) ? ring - pos : 0; // record must be contiguous
+    uint32_t used = q->reserve - atomic_load_explicit(&q->read, memory_order_acquire);
+    if (size < sizeof(MasqEventHeader) || size > 0xFFFF || used + skip + len > ring) {
+        return 0; // full (or the record can never fit)
+    }
+    uint8_t* area = (uint8_t*)(q + 1);
+    if (skip) {
+        ((MasqEventHeader*)(area + pos))->cap = QUEUE_PAD_CAP;
+        q->reserve += skip;
+        pos = 0;
+    }
+    MasqEventHeader* h = (MasqEventHeader*)(area + pos);
+    h->size = (uint16_t) size;
+    q->reserve += len;
+    return h;
+}
+
+static void qrt_queue_commit(qrt_queue_hdr* q) {
+    atomic_store_explicit(&q->write, q->reserve, memory_order_release);
+    // pairs with the fence in Queue_WaitTimeout: either we see 'sleeping'
+    // or the consumer sees the new 'write' before it sleeps.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sleeping, memory_order_relaxed)) {
+        uint32_t fiber = atomic_exchange_explicit(&q->fiber, 0, memory_order_acq_rel);
+        if (fiber) task_push(fiber);
+        else qrt_futex_wake(&q->write, 1);
+    }
+    if (svc_queue && q == qrt_cap(svc_queue)->buf && (uint32_t)SDL_ThreadID() != qrt_main_thread_id) {
+        // the main thread may be asleep in SDL_WaitEvent.
+        SDL_Event wake = {0};
+        wake.user.type = user_sdl_events + uev_wake;
+        SDL_PushEvent(&wake);
+    }
+}
+
+static MasqEventHeader* qrt_queue_peek(qrt_queue_hdr* q) {
+    uint32_t r = atomic_load_explicit(&q->read, memory_order_relaxed); // ours
+    uint32_t w = atomic_load_explicit(&q->write, memory_order_acquire);
+    while (r != w) {
+        MasqEventHeader* h = (MasqEventHeader*)((uint8_t*)(q + 1) + (r & q->size_mask));
+        if (h->cap != QUEUE_PAD_CAP) {
+            q->pending = r + QUEUE_ALIGN(h->size);
+            return h;
+        }
+        // consume the filler so the producer can reuse the tail.
+        r += (q->size_mask + 1) - (r & q->size_mask);
+        atomic_store_explicit(&q->read, r, memory_order_release);
+    }
+    return 0;
+}
+
+MasqEventHeader* Queue_Reserve(cap_t q_cap, size_t size) {
+    return qrt_queue_reserve(qrt_queue(q_cap), size);
+}
+
+void Queue_Commit(cap_t q_cap) {
+    qrt_queue_commit(qrt_queue(q_cap));
+}
+
+static int qrt_queue_post(qrt_queue_hdr* q, const MasqEventHeader* ev) {
+    SDL_AtomicLock(&q->post_lock);
+    MasqEventHeader* h = qrt_queue_reserve(q, ev->size);
+    if (h) {
+        memcpy(h, ev, ev->size);
+        qrt_queue_commit(q);
+    }
+    SDL_AtomicUnlock(&q->post_lock);
+    return h != 0;
+}
+
+int Queue_Post(cap_t q_cap, const MasqEventHeader* ev) {
+    return qrt_queue_post(qrt_queue(q_cap), ev);
+}
+
+// Post from a runtime thread, waiting while the ring is full. Runtime
+// threads may share a queue with each other and with the App's Queue_Post
+// (not with Queue_Reserve), since all of them take the producer lock.
+static void qrt_runtime_post(cap_t q_cap, const MasqEventHeader* ev) {
+    qrt_queue_hdr* q = qrt_cap(q_cap)->buf;
+    while (!qrt_queue_post(q, ev)) {
+        SDL_Delay(1); // let the consumer catch up
+    }
+}
 
 void Queue_Wait(cap_t q_cap) {
-    // HACK: can only be called on the FrameBuffer thread (main thread)
-    // printf("Queue_Wait %d\n", qwaitn++);
-    if (SDL_WaitEvent(NULL) != 1) {
-	printf("SDL_WaitEvent: how can this fail? %s\n", SDL_GetError());
+    Queue_WaitTimeout(q_cap, -1);
+}
+
+// Park hook: publish the fiber as the queue's waiter, unless data arrived
+// while it was switching out (same handshake as the futex path below).
+static void qrt_queue_park(void* obj, uint32_t idx) {
+    qrt_queue_hdr* q = obj;
+    atomic_store_explicit(&q->fiber, idx, memory_order_relaxed);
+    atomic_store_explicit(&q->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->write, memory_order_relaxed) != atomic_load_explicit(&q->read, memory_order_relaxed)) {
+        // take it back, unless the producer already pushed it.
+        if (atomic_exchange_explicit(&q->fiber, 0, memory_order_acq_rel)) task_push(idx);
+    }
+}
+
+static void qrt_pump_events(qrt_queue_hdr* q);
+
+int Queue_WaitTimeout(cap_t q_cap, int timeout_ms) {
+    qrt_queue_hdr* q = qrt_queue(q_cap);
+    if (qrt_queue_peek(q)) return 1;
+    uint32_t deadline = SDL_GetTicks() + (uint32_t)timeout_ms;
+    if (qrt_is_service_queue(q_cap)) {
+        // wait for SDL events and move them into the queue; some (uev_wake,
+        // window focus) translate to nothing, so keep waiting after those.
+        for (;;) {
+            int got;
+            if (timeout_ms < 0) {
+                got = SDL_WaitEvent(NULL);
+            } else {
+                int left = (int)(deadline - SDL_GetTicks());
+                got = SDL_WaitEventTimeout(NULL, left > 0 ? left : 0);
+            }
+            qrt_pump_events(q);
+            if (qrt_queue_peek(q)) return 1;
+            if (!got && timeout_ms >= 0) return 0;
+        }
+    }
+    if (timeout_ms < 0 && task_current_fiber()) {
+        // yield the worker until the producer commits.
+        do {
+            qrt_fiber_park(qrt_queue_park, q);
+            atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+        } while (!qrt_queue_peek(q));
+        return 1;
+    }
+    for (;;) {
+        uint32_t r = atomic_load_explicit(&q->read, memory_order_relaxed);
+        atomic_store_explicit(&q->sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&q->write, memory_order_relaxed) == r) {
+            int left = -1;
+            if (timeout_ms >= 0) {
+                left = (int)(deadline - SDL_GetTicks());
+                if (left <= 0) {
+                    atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+                    return 0;
+                }
+            }
+            qrt_futex_wait(&q->write, r, left);
+        }
+        atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+        if (qrt_queue_peek(q)) return 1;
     }
 }
 
@@ -267,165 +1521,912 @@ static uint16_t hid_btn_map[8] = {
     Input_Button8,
 };
 
-MasqEventHeader* Queue_Read(cap_t q_cap) {
-    // Pump SDL events.
-    // HACK: can only be called on the FrameBuffer thread (main thread)
-    if (SDL_PollEvent(&event)) {
-        switch (event.type) {
-            case SDL_QUIT: {
-                gen_event.h.cap = System_Cap;
-                gen_event.h.event = System_Quit;
-                gen_event.h.size = sizeof(MasqEvent);
-                return &gen_event.h;
-            }
-            case SDL_KEYDOWN: {
-                key_event.h.cap = 4; // ddev_input
-                key_event.h.event = Input_KeyDown;
-                key_event.h.size = sizeof(Input_KeyEvent);
-                key_event.keycode = event.key.keysym.scancode; // USB usage (same as Input_KeyCode)
-                key_event.modifiers = hid_mods(event.key.keysym.mod); // USB usage
-                return &key_event.h;
-            }
-            case SDL_KEYUP: {
-                key_event.h.cap = 4; // ddev_input
-                key_event.h.event = Input_KeyUp;
-                key_event.h.size = sizeof(Input_KeyEvent);
-                key_event.keycode = event.key.keysym.scancode; // USB usage (same as Input_KeyCode)
-                key_event.modifiers = hid_mods(event.key.keysym.mod); // USB usage
-                return &key_event.h;
+// Translate one SDL event into (zero or one) reserved queue records.
+// 'motion' is the previous record if it is an unpublished PointerMove that
+// can absorb this event. Returns the record written (or merged into), if any.
+static MasqEventHeader* qrt_translate_event(qrt_queue_hdr* q, SDL_Event* event, Input_PointerEvent* motion) {
+    switch (event->type) {
+        case SDL_QUIT: {
+            MasqEvent* gen_event = (MasqEvent*) qrt_queue_reserve(q, sizeof(MasqEvent));
+            if (!gen_event) return 0;
+            gen_event->h.cap = System_Cap;
+            gen_event->h.event = System_Quit;
+            return &gen_event->h;
+        }
+        case SDL_KEYDOWN:
+        case SDL_KEYUP: {
+            Input_KeyEvent* key_event = (Input_KeyEvent*) qrt_queue_reserve(q, sizeof(Input_KeyEvent));
+            if (!key_event) return 0;
+            key_event->h.cap = 4; // ddev_input
+            key_event->h.event = event->type == SDL_KEYDOWN ? Input_KeyDown : Input_KeyUp;
+            key_event->keycode = event->key.keysym.scancode; // USB usage (same as Input_KeyCode)
+            key_event->modifiers = hid_mods(event->key.keysym.mod); // USB usage
+            return &key_event->h;
+        }
+        case SDL_MOUSEMOTION: {
+            uint16_t buttons = hid_buttons(event->motion.state); // USB usage
+            if (motion && motion->buttons == buttons) {
+                // coalesce relative motion with unchanged buttons.
+                motion->x += event->motion.xrel;
+                motion->y += event->motion.yrel;
+                return &motion->h;
             }
-            case SDL_MOUSEMOTION: {
-                ptr_event.h.cap = 4; // ddev_input
-                ptr_event.h.event = Input_PointerMove;
-                ptr_event.h.size = sizeof(Input_PointerEvent);
-                // if (ptr_relative) {
-                    ptr_event.x = event.motion.xrel;
-                    ptr_event.y = event.motion.yrel;
-                // } else {
-                //     ptr_event.x = event.motion.x;
-                //     ptr_event.y = event.motion.y;
-                // }
-                ptr_event.buttons = ptr_btns = hid_buttons(event.motion.state); // USB usage
-                return &ptr_event.h;
+            Input_PointerEvent* ptr_event = (Input_PointerEvent*) qrt_queue_reserve(q, sizeof(Input_PointerEvent));
+            if (!ptr_event) return 0;
+            ptr_event->h.cap = 4; // ddev_input
+            ptr_event->h.event = Input_PointerMove;
+            ptr_event->device = 0;
+            // if (ptr_relative) {
+                ptr_event->x = event->motion.xrel;
+                ptr_event->y = event->motion.yrel;
+            // } else {
+            //     ptr_event->x = event->motion.x;
+            //     ptr_event->y = event->motion.y;
+            // }
+            ptr_event->buttons = ptr_btns = buttons;
+            return &ptr_event->h;
+        }
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP: {
+            Input_PointerEvent* ptr_event = (Input_PointerEvent*) qrt_queue_reserve(q, sizeof(Input_PointerEvent));
+            if (!ptr_event) return 0;
+            ptr_event->h.cap = 4; // ddev_input
+            ptr_event->device = 0;
+            ptr_event->x = event->button.x;
+            ptr_event->y = event->button.y;
+            if (event->type == SDL_MOUSEBUTTONDOWN) {
+                ptr_event->h.event = Input_ButtonDown;
+                ptr_btns |= hid_btn_map[(event->button.button-1) & 7]; // USB usage
+            } else {
+                ptr_event->h.event = Input_ButtonUp;
+                ptr_btns &= ~hid_btn_map[(event->button.button-1) & 7]; // USB usage
             }
-            case SDL_MOUSEBUTTONDOWN: {
-                ptr_event.h.cap = 4; // ddev_input
-                ptr_event.h.event = Input_ButtonDown;
-                ptr_event.h.size = sizeof(Input_PointerEvent);
-                ptr_event.x = event.button.x;
-                ptr_event.y = event.button.y;
-                ptr_btns |= hid_btn_map[(event.button.button-1) & 7]; // USB usage
-                ptr_event.buttons = ptr_btns;
-                return &ptr_event.h;
-            }
-            case SDL_MOUSEBUTTONUP: {
-                ptr_event.h.cap = 4; // ddev_input
-                ptr_event.h.event = Input_ButtonUp;
-                ptr_event.h.size = sizeof(Input_PointerEvent);
-                ptr_event.x = event.button.x;
-                ptr_event.y = event.button.y;
-                ptr_btns &= ~hid_btn_map[(event.button.button-1) & 7]; // USB usage
-                ptr_event.buttons = ptr_btns;
-                return &ptr_event.h;
-            }
-            case SDL_MOUSEWHEEL: {
-                return &no_event.h;
-            }
-            case SDL_WINDOWEVENT: {
-                switch (event.window.event) {
-                    case SDL_WINDOWEVENT_ENTER:
-                    case SDL_WINDOWEVENT_FOCUS_GAINED: {
-                        printf("SDL_WINDOWEVENT_FOCUS_GAINED\n");
-                        if (!ptr_relative) {
-                            ptr_relative = 1;
-                            SDL_SetRelativeMouseMode(SDL_TRUE);
-                        }
-                        return &no_event.h;
+            ptr_event->buttons = ptr_btns;
+            return &ptr_event->h;
+        }
+        case SDL_MOUSEWHEEL: {
+            return 0;
+        }
+        case SDL_WINDOWEVENT: {
+            switch (event->window.event) {
+                case SDL_WINDOWEVENT_ENTER:
+                case SDL_WINDOWEVENT_FOCUS_GAINED: {
+                    printf("SDL_WINDOWEVENT_FOCUS_GAINED\n");
+                    if (!ptr_relative) {
+                        ptr_relative = 1;
+                        SDL_SetRelativeMouseMode(SDL_TRUE);
                     }
-                    case SDL_WINDOWEVENT_LEAVE:
-                    case SDL_WINDOWEVENT_FOCUS_LOST: {
-                        if (ptr_relative) {
-                            printf("SDL_WINDOWEVENT_FOCUS_LOST\n");
-                            ptr_relative = 0;
-                            SDL_SetRelativeMouseMode(SDL_FALSE);
-                        }
-                        return &no_event.h;
+                    return 0;
+                }
+                case SDL_WINDOWEVENT_LEAVE:
+                case SDL_WINDOWEVENT_FOCUS_LOST: {
+                    if (ptr_relative) {
+                        printf("SDL_WINDOWEVENT_FOCUS_LOST\n");
+                        ptr_relative = 0;
+                        SDL_SetRelativeMouseMode(SDL_FALSE);
                     }
+                    return 0;
                 }
-                return &no_event.h;
             }
-            default: {
-                if (event.type == user_sdl_events + uev_fb_frame) {
-                    fb_frame.h.cap = fb_cap;
-                    fb_frame.h.event = FrameBuffer_Frame;
-                    fb_frame.h.size = sizeof(FrameBuffer_FrameEvent);
-                    fb_frame.buf_cap = (size_t) event.user.data1;
-                    fb_frame.dt_ms = 1;
-                    return &fb_frame.h;
-                }
+            return 0;
+        }
+        default: {
+            if (event->type == user_sdl_events + uev_fb_frame) {
+                FrameBuffer_FrameEvent* fb_frame = (FrameBuffer_FrameEvent*) qrt_queue_reserve(q, sizeof(FrameBuffer_FrameEvent));
+                if (!fb_frame) return 0;
+                fb_frame->h.cap = fb_cap;
+                fb_frame->h.event = FrameBuffer_Frame;
+                fb_frame->buf_cap = (size_t) event->user.data1;
+                fb_frame->dt_ms = 1;
+                return &fb_frame->h;
             }
         }
     }
-    return &no_event.h;
+    return 0;
+}
+
+// Move all pending SDL events into the service queue in one pass (as far as
+// space allows), merging runs of pointer motion, then publish them together.
+static void qrt_pump_events(qrt_queue_hdr* q) {
+    SDL_Event events[QUEUE_PUMP_MAX];
+    MasqEventHeader* last = 0;
+    uint32_t ring = q->size_mask + 1;
+    int max, n;
+    SDL_PumpEvents();
+    SDL_AtomicLock(&q->post_lock);
+    do {
+        // each event needs at most one record, plus one filler per pass.
+        uint32_t space = ring - (q->reserve - atomic_load_explicit(&q->read, memory_order_acquire));
+        if (space < 2 * QUEUE_PUMP_RECORD) break;
+        max = space / QUEUE_PUMP_RECORD - 1;
+        if (max > QUEUE_PUMP_MAX) max = QUEUE_PUMP_MAX;
+        n = SDL_PeepEvents(events, max, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT);
+        for (int i = 0; i < n; i++) {
+            Input_PointerEvent* motion = 0;
+            if (last && last->cap == 4 && last->event == Input_PointerMove) {
+                motion = (Input_PointerEvent*) last;
+            }
+            MasqEventHeader* h = qrt_translate_event(q, &events[i], motion);
+            if (h) last = h;
+        }
+    } while (n == max);
+    if (last) qrt_queue_commit(q);
+    SDL_AtomicUnlock(&q->post_lock);
+}
+
+MasqEventHeader* Queue_Read(cap_t q_cap) {
+    qrt_queue_hdr* q = qrt_queue(q_cap);
+    MasqEventHeader* h = qrt_queue_peek(q);
+    if (!h && qrt_is_service_queue(q_cap)) {
+        qrt_pump_events(q);
+        h = qrt_queue_peek(q);
+    }
+    // points directly into the ring; valid until Queue_Advance.
+    return h ? h : &no_event.h;
+}
+
+size_t Queue_ReadBatch(cap_t q_cap, MasqEventHeader** first) {
+    qrt_queue_hdr* q = qrt_queue(q_cap);
+    if (qrt_is_service_queue(q_cap)) {
+        qrt_pump_events(q);
+    }
+    MasqEventHeader* h = qrt_queue_peek(q);
+    if (!h) {
+        *first = &no_event.h;
+        return 0;
+    }
+    // extend the run up to the end of the ring (or the first filler).
+    uint8_t* area = (uint8_t*)(q + 1);
+    uint32_t w = atomic_load_explicit(&q->write, memory_order_acquire);
+    uint32_t r = q->pending;
+    uint32_t start = r - QUEUE_ALIGN(h->size);
+    uint32_t end = start - (start & q->size_mask) + q->size_mask + 1;
+    size_t count = 1;
+    while (r != w && r != end) {
+        MasqEventHeader* e = (MasqEventHeader*)(area + (r & q->size_mask));
+        if (e->cap == QUEUE_PAD_CAP) break;
+        r += QUEUE_ALIGN(e->size);
+        count++;
+    }
+    q->pending = r;
+    *first = h;
+    return count;
 }
 
 void Queue_Advance(cap_t q_cap) {
+    qrt_queue_hdr* q = qrt_cap(q_cap)->buf;
+    if (!q) return;
+    uint32_t r = atomic_load_explicit(&q->read, memory_order_relaxed);
+    if ((int32_t)(q->pending - r) > 0) {
+        atomic_store_explicit(&q->read, q->pending, memory_order_release);
+    }
 }
 
 int Queue_Empty(cap_t q_cap) {
-    return !(SDL_PollEvent(NULL));
+    qrt_queue_hdr* q = qrt_queue(q_cap);
+    uint32_t pending = q->pending; // don't disturb an unread Queue_Read
+    MasqEventHeader* h = qrt_queue_peek(q);
+    q->pending = pending;
+    if (h) return 0;
+    if (qrt_is_service_queue(q_cap)) {
+        return !(SDL_PollEvent(NULL));
+    }
+    return 1;
 }
 
 
 // STORAGE
 
-int Storage_ObjectExists(const char* name) {
-    if (access(name, 0) != -1) return 1;
+// Name cache: name -> (fd, size, mtime) for objects seen recently, so the
+// asset layer's repeated lookups skip the path walk. At most
+// STORAGE_CACHE_FDS entries keep an open descriptor (least recently used
+// ones are closed first); caps get a dup of it. Objects replaced through
+// this runtime are forgotten; for changes made by other processes, a hit
+// older than STORAGE_CACHE_TTL_MS stats the name again and drops the entry
+// if the inode, size or mtime changed.
+
+#define STORAGE_CACHE_BUCKETS 256 // power of two
+#define STORAGE_CACHE_ENTRIES 1024
+#define STORAGE_CACHE_FDS 64
+#define STORAGE_CACHE_TTL_MS 250
+
+typedef struct storage_entryS {
+    struct storage_entryS* hnext; // hash chain
+    struct storage_entryS* prev;  // LRU list, most recent first
+    struct storage_entryS* next;
+    uint32_t hash;
+    int fd;                       // -1: metadata only
+    size_t size;
+    int64_t mtime;                // ns
+    dev_t dev;
+    ino_t ino;
+    uint32_t checked;             // SDL_GetTicks() of the last stat
+    char name[];
+} storage_entry;
+
+static storage_entry* storage_cache[STORAGE_CACHE_BUCKETS] = {0};
+static storage_entry* storage_lru_head = 0;
+static storage_entry* storage_lru_tail = 0;
+static uint32_t storage_cache_count = 0;
+static uint32_t storage_cache_fds = 0;
+static SDL_SpinLock storage_cache_lock = 0;
+
+static uint32_t storage_hash(const char* name) {
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*name) h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h;
+}
+
+static void storage_lru_unlink(storage_entry* e) {
+    if (e->prev) e->prev->next = e->next;
+    else storage_lru_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else storage_lru_tail = e->prev;
+}
+
+static void storage_lru_push(storage_entry* e) {
+    e->prev = 0;
+    e->next = storage_lru_head;
+    if (storage_lru_head) storage_lru_head->prev = e;
+    else storage_lru_tail = e;
+    storage_lru_head = e;
+}
+
+// Under storage_cache_lock. Found entries become most recently used.
+static storage_entry* storage_cache_find(const char* name, uint32_t hash) {
+    for (storage_entry* e = storage_cache[hash & (STORAGE_CACHE_BUCKETS-1)]; e; e = e->hnext) {
+        if (e->hash == hash && !strcmp(e->name, name)) {
+            storage_lru_unlink(e);
+            storage_lru_push(e);
+            return e;
+        }
+    }
     return 0;
 }
 
+static void storage_cache_drop_fd(storage_entry* e) {
+    if (e->fd != -1) {
+        close(e->fd);
+        e->fd = -1;
+        storage_cache_fds--;
+    }
+}
+
+static void storage_cache_remove(storage_entry* e) {
+    storage_entry** link = &storage_cache[e->hash & (STORAGE_CACHE_BUCKETS-1)];
+    while (*link != e) link = &(*link)->hnext;
+    *link = e->hnext;
+    storage_lru_unlink(e);
+    storage_cache_drop_fd(e);
+    storage_cache_count--;
+    free(e);
+}
+
+// Under storage_cache_lock. Takes ownership of fd (may be -1).
+static void storage_cache_add(const char* name, uint32_t hash, int fd, const struct stat* st) {
+    storage_entry* e = storage_cache_find(name, hash);
+    if (!e) {
+        size_t len = strlen(name);
+        e = malloc(sizeof(storage_entry) + len + 1);
+        if (!e) {
+            if (fd != -1) close(fd);
+            return;
+        }
+        memcpy(e->name, name, len + 1);
+        e->hash = hash;
+        e->fd = -1;
+        e->hnext = storage_cache[hash & (STORAGE_CACHE_BUCKETS-1)];
+        storage_cache[hash & (STORAGE_CACHE_BUCKETS-1)] = e;
+        storage_lru_push(e);
+        storage_cache_count++;
+    }
+    if (fd != -1) {
+        storage_cache_drop_fd(e);
+        e->fd = fd;
+        storage_cache_fds++;
+    }
+    e->size = (size_t) st->st_size;
+    e->mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->checked = SDL_GetTicks();
+    // evict from the cold end: whole entries past the entry bound,
+    // then descriptors past the fd bound.
+    while (storage_cache_count > STORAGE_CACHE_ENTRIES) {
+        storage_cache_remove(storage_lru_tail);
+    }
+    for (storage_entry* old = storage_lru_tail; old && storage_cache_fds > STORAGE_CACHE_FDS; old = old->prev) {
+        storage_cache_drop_fd(old);
+    }
+}
+
+static int storage_cache_same(const storage_entry* e, const struct stat* st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == (size_t) st->st_size &&
+        e->mtime == (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Find 'name', revalidating entries not checked within STORAGE_CACHE_TTL_MS;
+// an entry whose object changed or vanished is dropped. Returns with
+// storage_cache_lock held.
+static storage_entry* storage_cache_lookup(const char* name, uint32_t hash) {
+    SDL_AtomicLock(&storage_cache_lock);
+    storage_entry* e = storage_cache_find(name, hash);
+    uint32_t now = SDL_GetTicks();
+    if (!e || now - e->checked < STORAGE_CACHE_TTL_MS) return e;
+    SDL_AtomicUnlock(&storage_cache_lock);
+    struct stat st;
+    int found = stat(name, &st) == 0;
+    SDL_AtomicLock(&storage_cache_lock);
+    e = storage_cache_find(name, hash); // may have gone while unlocked
+    if (e && (!found || !storage_cache_same(e, &st))) {
+        storage_cache_remove(e);
+        e = 0;
+    }
+    if (e) e->checked = now;
+    return e;
+}
+
+static void storage_cache_forget(const char* name) {
+    uint32_t hash = storage_hash(name);
+    SDL_AtomicLock(&storage_cache_lock);
+    storage_entry* e = storage_cache_find(name, hash);
+    if (e) storage_cache_remove(e);
+    SDL_AtomicUnlock(&storage_cache_lock);
+}
+
+// Returns a descriptor owned by the caller, through the cache.
+static int storage_cache_open(const char* name, size_t* size) {
+    uint32_t hash = storage_hash(name);
+    int fd = -1;
+    storage_entry* e = storage_cache_lookup(name, hash);
+    if (e && e->fd != -1) {
+        fd = dup(e->fd);
+        *size = e->size;
+    }
+    SDL_AtomicUnlock(&storage_cache_lock);
+    if (fd != -1) return fd;
+
+    fd = open(name, O_RDONLY, 0);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    *size = (size_t) st.st_size;
+    SDL_AtomicLock(&storage_cache_lock);
+    storage_cache_add(name, hash, dup(fd), &st);
+    SDL_AtomicUnlock(&storage_cache_lock);
+    return fd;
+}
+
+int Storage_ObjectExists(const char* name) {
+    uint32_t hash = storage_hash(name);
+    storage_entry* e = storage_cache_lookup(name, hash);
+    SDL_AtomicUnlock(&storage_cache_lock);
+    if (e) return 1;
+    struct stat st;
+    if (stat(name, &st) != 0) return 0;
+    SDL_AtomicLock(&storage_cache_lock);
+    storage_cache_add(name, hash, -1, &st);
+    SDL_AtomicUnlock(&storage_cache_lock);
+    return 1;
+}
+
 cap_t Storage_FindObject(const char* name) {
-    int fd = open(name, O_RDONLY, 0);
+    size_t size;
+    int fd = storage_cache_open(name, &size);
     if (fd == -1) return 0;
-    off_t size = lseek(fd, 0, SEEK_END);
-    cap_t handle = next_cap++;
-    caps[handle].buf = 0;
-    caps[handle].size = (size_t) size;
-    caps[handle].fd = fd;
+    cap_t handle = qrt_cap_alloc();
+    if (!handle) {
+        close(fd);
+        return 0;
+    }
+    capinfo* c = qrt_cap(handle);
+    c->buf = 0;
+    c->size = (size_t) size;
+    c->fd = fd;
+    return handle;
+}
+
+cap_t Storage_MapObject(const char* name, Storage_MapOpts opts) {
+    size_t size;
+    int fd = storage_cache_open(name, &size);
+    if (fd == -1) return 0;
+    // the mapping must not extend past the file (SIGBUS): use its current size.
+    struct stat st;
+    if (fstat(fd, &st) == 0) size = (size_t) st.st_size;
+    void* mem = 0;
+    if (size) {
+        mem = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem == MAP_FAILED) {
+            printf("[RT] mmap (%s): %s\n", name, strerror(errno));
+            close(fd);
+            return 0;
+        }
+    }
+    close(fd); // the mapping keeps the file referenced
+    if (mem) {
+        if (opts & Storage_MapSequential) madvise(mem, size, MADV_SEQUENTIAL);
+        if (opts & Storage_MapRandom) madvise(mem, size, MADV_RANDOM);
+        if (opts & Storage_MapWillNeed) madvise(mem, size, MADV_WILLNEED);
+    }
+    cap_t handle = qrt_cap_alloc();
+    if (!handle) {
+        if (mem) munmap(mem, size);
+        return 0;
+    }
+    capinfo* c = qrt_cap(handle);
+    c->buf = mem;
+    c->size = size;
+    c->kind = CAP_KIND_FILE;
     return handle;
 }
 
 size_t Storage_ObjectSize(cap_t handle) {
-    return caps[handle].size;
+    capinfo* c = qrt_cap_live(handle);
+    return c ? c->size : 0;
 }
 
-int Storage_CopyToMemory(cap_t handle, void* address, size_t ofs, size_t len) {
+static int storage_copy(cap_t handle, void* address, size_t ofs, size_t len) {
     ssize_t n;
     char* to = address;
-    lseek(caps[handle].fd, (off_t)ofs, SEEK_SET);
+    capinfo* c = qrt_cap_live(handle);
+    if (!c || !c->fd) return -1; // stale or not a storage object
+    // pread: tasks can share a handle without racing on the file offset.
     do {
-        n = read(caps[handle].fd, to, len);
+        n = pread(c->fd, to, len, (off_t)ofs);
         if (n < 1) return -1; // early EOF or error reading
         len -= n;
         to += n;
+        ofs += n;
     } while (len>0);
     return 0;
 }
 
+// Async reads: batches are queued for a small pool of I/O threads, which
+// claim requests one at a time so a batch spreads across the pool. The
+// thread finishing a batch's last request posts Storage_ReadDone.
+
+#define STORAGE_IO_THREADS 4
+
+typedef struct storage_batchS {
+    struct storage_batchS* next;
+    cap_t st_cap;
+    cap_t queue_cap;
+    size_t tag;
+    uint32_t count;
+    uint32_t claimed;            // under storage_io_lock
+    _Atomic uint32_t left;
+    _Atomic uint32_t failed;
+    _Atomic size_t bytes;
+    char** names;                // Storage_Prefetch batch (no reqs)
+    uint32_t fiber;              // blocking read from a fiber: resume it instead of posting
+    Storage_ReadRequest reqs[];
+} storage_batch;
+
+static SDL_mutex* storage_io_lock = 0;
+static SDL_cond* storage_io_cond = 0;
+static storage_batch* storage_io_head = 0;
+static storage_batch* storage_io_tail = 0;
+static SDL_SpinLock storage_io_start = 0;
+static _Atomic int storage_io_ready = 0;
+
+// Open through the cache (so a later FindObject is a hit) and ask the
+// kernel to start reading the whole object into the page cache.
+static void storage_prefetch_one(const char* name) {
+    size_t size;
+    int fd = storage_cache_open(name, &size);
+    if (fd == -1) return;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, (off_t) size, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+}
+
+static int storage_io_main(void* unused) {
+    for (;;) {
+        SDL_LockMutex(storage_io_lock);
+        while (!storage_io_head) {
+            SDL_CondWait(storage_io_cond, storage_io_lock);
+        }
+        storage_batch* b = storage_io_head;
+        uint32_t i = b->claimed++;
+        if (b->claimed == b->count) {
+            storage_io_head = b->next;
+            if (!storage_io_head) storage_io_tail = 0;
+        }
+        SDL_UnlockMutex(storage_io_lock);
+
+        if (b->names) {
+            storage_prefetch_one(b->names[i]);
+        } else if (storage_copy(b->reqs[i].handle, b->reqs[i].address, b->reqs[i].ofs, b->reqs[i].len) == 0) {
+            atomic_fetch_add_explicit(&b->bytes, b->reqs[i].len, memory_order_relaxed);
+        } else {
+            atomic_fetch_add_explicit(&b->failed, 1, memory_order_relaxed);
+        }
+        if (atomic_fetch_sub_explicit(&b->left, 1, memory_order_acq_rel) == 1) {
+            if (b->fiber) {
+                task_push(b->fiber); // the fiber frees the batch
+                continue;
+            }
+            if (!b->names) {
+                Storage_ReadDoneEvent done = {0};
+                done.h.cap = b->st_cap;
+                done.h.size = sizeof(done);
+                done.h.event = Storage_ReadDone;
+                done.tag = b->tag;
+                done.count = b->count;
+                done.failed = atomic_load_explicit(&b->failed, memory_order_relaxed);
+                done.bytes = atomic_load_explicit(&b->bytes, memory_order_relaxed);
+                qrt_runtime_post(b->queue_cap, &done.h);
+            }
+            free(b->names);
+            free(b);
+        }
+    }
+    return 0;
+}
+
+static int storage_io_init(void) {
+    SDL_AtomicLock(&storage_io_start);
+    if (!atomic_load(&storage_io_ready)) {
+        storage_io_lock = SDL_CreateMutex();
+        storage_io_cond = SDL_CreateCond();
+        int started = 0;
+        for (int i=0; i<STORAGE_IO_THREADS; i++) {
+            SDL_Thread* t = SDL_CreateThread(storage_io_main, "storage-io", NULL);
+            if (!t) {
+                printf("[RT] SDL_CreateThread: %s\n", SDL_GetError());
+                continue;
+            }
+            SDL_DetachThread(t);
+            started++;
+        }
+        atomic_store(&storage_io_ready, started > 0);
+    }
+    SDL_AtomicUnlock(&storage_io_start);
+    return atomic_load(&storage_io_ready);
+}
+
+static storage_batch* storage_batch_new(size_t count, size_t reqs) {
+    if (!count) return 0;
+    if (!atomic_load(&storage_io_ready) && !storage_io_init()) return 0;
+    storage_batch* b = malloc(sizeof(storage_batch) + reqs * sizeof(Storage_ReadRequest));
+    if (!b) return 0;
+    b->next = 0;
+    b->st_cap = 0;
+    b->queue_cap = 0;
+    b->tag = 0;
+    b->count = (uint32_t) count;
+    b->claimed = 0;
+    atomic_init(&b->left, (uint32_t) count);
+    atomic_init(&b->failed, 0);
+    atomic_init(&b->bytes, 0);
+    b->names = 0;
+    b->fiber = 0;
+    return b;
+}
+
+static void storage_batch_submit(storage_batch* b) {
+    SDL_LockMutex(storage_io_lock);
+    if (storage_io_tail) storage_io_tail->next = b;
+    else storage_io_head = b;
+    storage_io_tail = b;
+    SDL_UnlockMutex(storage_io_lock);
+    SDL_CondBroadcast(storage_io_cond);
+}
+
+// Park hook: the fiber is switched out, so the read can start.
+static void storage_park(void* obj, uint32_t idx) {
+    storage_batch* b = obj;
+    b->fiber = idx;
+    storage_batch_submit(b);
+}
+
+int Storage_CopyToMemory(cap_t handle, void* address, size_t ofs, size_t len) {
+    storage_batch* b;
+    if (!task_current_fiber() || !(b = storage_batch_new(1, 1))) {
+        return storage_copy(handle, address, ofs, len);
+    }
+    // in a fiber: let the worker run other tasks during the read.
+    b->reqs[0].handle = handle;
+    b->reqs[0].ofs = ofs;
+    b->reqs[0].len = len;
+    b->reqs[0].address = address;
+    qrt_fiber_park(storage_park, b);
+    int result = atomic_load_explicit(&b->failed, memory_order_acquire) ? -1 : 0;
+    free(b);
+    return result;
+}
+
+int Storage_ReadAsync(cap_t st_cap, const Storage_ReadRequest* reqs, size_t count, cap_t queue_cap, size_t tag) {
+    storage_batch* b = storage_batch_new(count, count);
+    if (!b) return -1;
+    b->st_cap = st_cap;
+    b->queue_cap = queue_cap;
+    b->tag = tag;
+    memcpy(b->reqs, reqs, count * sizeof(Storage_ReadRequest));
+    qrt_queue(queue_cap); // create it here rather than on an I/O thread
+    storage_batch_submit(b);
+    return 0;
+}
+
+int Storage_Prefetch(const char* const* names, size_t count) {
+    storage_batch* b = storage_batch_new(count, 0);
+    if (!b) return -1;
+    // one block: the pointer array, then copies of the names.
+    size_t bytes = count * sizeof(char*);
+    for (size_t i=0; i<count; i++) bytes += strlen(names[i]) + 1;
+    b->names = malloc(bytes);
+    if (!b->names) {
+        free(b);
+        return -1;
+    }
+    char* to = (char*)(b->names + count);
+    for (size_t i=0; i<count; i++) {
+        size_t len = strlen(names[i]) + 1;
+        memcpy(to, names[i], len);
+        b->names[i] = to;
+        to += len;
+    }
+    storage_batch_submit(b);
+    return 0;
+}
+
 int Storage_CreateObject(const char* name, cap_t buf_cap, size_t size) {
-    void* data = caps[buf_cap].buf;
-    int n, fd = open(name, O_CREAT|O_TRUNC|O_RDWR, 0666);
+    const char* data = Buffer_Address(buf_cap);
+    ssize_t n;
+    storage_cache_forget(name);
+    int fd = open(name, O_CREAT|O_TRUNC|O_RDWR, 0666);
     if (fd == -1) return -1;
-    do {
+    while (size > 0) {
         n = write(fd, data, size);
-        if (n < 1) return -1; // early EOF or error reading
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 1) {
+            close(fd); // error writing; don't leak the fd
+            return -1;
+        }
         size -= n;
-    } while (size>0);
-    fd = close(fd);
-    if (fd == -1) return -1;
+        data += n;
+    }
+    // close can report a deferred write error (e.g. NFS, full disk).
+    int err = close(fd);
+    storage_cache_forget(name); // in case it was looked up meanwhile
+    if (err == -1) return -1;
+    return 0;
+}
+
+// Streaming writer: chunks are copied and queued for one background thread,
+// which writes runs of queued chunks with writev into '<name>.tmp', then on
+// commit syncs, closes and renames over 'name', so readers never see a
+// partial object. Errors are sticky and reported in Storage_WriteDone.
+
+#define STORAGE_IOV_MAX 64
+
+enum storage_op_kindE {
+    STORAGE_OP_CHUNK,
+    STORAGE_OP_COMMIT,
+    STORAGE_OP_ABORT,
+};
+
+typedef struct storage_writerS {
+    int fd;
+    int error;        // first errno seen (writer thread)
+    size_t written;   // bytes written (writer thread)
+    char* path;
+    char* tmp_path;
+} storage_writer;
+
+typedef struct storage_opS {
+    struct storage_opS* next;
+    cap_t w_cap;
+    storage_writer* w;
+    int kind;
+    cap_t queue_cap;  // commit
+    size_t tag;       // commit
+    size_t len;       // chunk
+    uint8_t data[];
+} storage_op;
+
+static SDL_mutex* storage_wr_lock = 0;
+static SDL_cond* storage_wr_cond = 0;
+static storage_op* storage_wr_head = 0;
+static storage_op* storage_wr_tail = 0;
+static SDL_SpinLock storage_wr_start = 0;
+static _Atomic int storage_wr_ready = 0;
+
+static void storage_write_chunks(storage_writer* w, storage_op** ops, int count) {
+    struct iovec iov[STORAGE_IOV_MAX];
+    int first = 0;
+    for (int i=0; i<count; i++) {
+        iov[i].iov_base = ops[i]->data;
+        iov[i].iov_len = ops[i]->len;
+    }
+    while (!w->error && first < count) {
+        ssize_t n = writev(w->fd, &iov[first], count - first);
+        if (n < 0) {
+            if (errno != EINTR) w->error = errno;
+            continue;
+        }
+        if (n == 0) {
+            w->error = EIO;
+            break;
+        }
+        w->written += n;
+        // skip what was written; a short write resumes mid-chunk.
+        while (first < count && (size_t) n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < count) {
+            iov[first].iov_base = (uint8_t*) iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+}
+
+static void storage_finish_writer(storage_op* op) {
+    storage_writer* w = op->w;
+    if (op->kind == STORAGE_OP_COMMIT) {
+        // drop any preallocated tail, then make the data durable before rename.
+        if (!w->error && ftruncate(w->fd, (off_t) w->written) != 0) w->error = errno;
+        if (!w->error && fsync(w->fd) != 0) w->error = errno;
+    }
+    if (close(w->fd) != 0 && !w->error) w->error = errno;
+    if (op->kind == STORAGE_OP_COMMIT && !w->error) {
+        if (rename(w->tmp_path, w->path) != 0) w->error = errno;
+        storage_cache_forget(w->path);
+    }
+    if (op->kind == STORAGE_OP_ABORT || w->error) {
+        unlink(w->tmp_path);
+    }
+    if (op->kind == STORAGE_OP_COMMIT && op->queue_cap) {
+        Storage_WriteDoneEvent done = {0};
+        done.h.cap = op->w_cap;
+        done.h.size = sizeof(done);
+        done.h.event = Storage_WriteDone;
+        done.tag = op->tag;
+        done.error = w->error;
+        done.bytes = w->written;
+        qrt_runtime_post(op->queue_cap, &done.h);
+    }
+    free(w->path);
+    free(w->tmp_path);
+    free(w);
+}
+
+static int storage_writer_main(void* unused) {
+    storage_op* ops[STORAGE_IOV_MAX];
+    for (;;) {
+        SDL_LockMutex(storage_wr_lock);
+        while (!storage_wr_head) {
+            SDL_CondWait(storage_wr_cond, storage_wr_lock);
+        }
+        // take a run of chunks for one writer, to write with one writev.
+        int count = 0;
+        storage_op* op = storage_wr_head;
+        do {
+            ops[count++] = op;
+            op = op->next;
+        } while (op && count < STORAGE_IOV_MAX && ops[0]->kind == STORAGE_OP_CHUNK &&
+                 op->kind == STORAGE_OP_CHUNK && op->w == ops[0]->w);
+        storage_wr_head = op;
+        if (!op) storage_wr_tail = 0;
+        SDL_UnlockMutex(storage_wr_lock);
+
+        if (ops[0]->kind == STORAGE_OP_CHUNK) {
+            storage_write_chunks(ops[0]->w, ops, count);
+        } else {
+            storage_finish_writer(ops[0]);
+        }
+        for (int i=0; i<count; i++) free(ops[i]);
+    }
+    return 0;
+}
+
+static int storage_writer_init(void) {
+    SDL_AtomicLock(&storage_wr_start);
+    if (!atomic_load(&storage_wr_ready)) {
+        storage_wr_lock = SDL_CreateMutex();
+        storage_wr_cond = SDL_CreateCond();
+        SDL_Thread* t = SDL_CreateThread(storage_writer_main, "storage-write", NULL);
+        if (t) {
+            SDL_DetachThread(t);
+            atomic_store(&storage_wr_ready, 1);
+        } else {
+            printf("[RT] SDL_CreateThread: %s\n", SDL_GetError());
+        }
+    }
+    SDL_AtomicUnlock(&storage_wr_start);
+    return atomic_load(&storage_wr_ready);
+}
+
+static void storage_queue_op(storage_op* op) {
+    op->next = 0;
+    SDL_LockMutex(storage_wr_lock);
+    if (storage_wr_tail) storage_wr_tail->next = op;
+    else storage_wr_head = op;
+    storage_wr_tail = op;
+    SDL_UnlockMutex(storage_wr_lock);
+    SDL_CondSignal(storage_wr_cond);
+}
+
+static storage_op* storage_writer_op(cap_t w_cap, int kind, size_t len) {
+    capinfo* c = qrt_cap_live(w_cap);
+    if (!c || c->kind != CAP_KIND_WRITER) return 0;
+    storage_op* op = malloc(sizeof(storage_op) + len);
+    if (!op) return 0;
+    op->w_cap = w_cap;
+    op->w = c->buf;
+    op->kind = kind;
+    op->queue_cap = 0;
+    op->tag = 0;
+    op->len = len;
+    return op;
+}
+
+cap_t Storage_OpenWriter(const char* name, size_t size_hint) {
+    if (!atomic_load(&storage_wr_ready) && !storage_writer_init()) return 0;
+    storage_writer* w = calloc(1, sizeof(storage_writer));
+    size_t len = strlen(name);
+    w->path = malloc(len + 1);
+    w->tmp_path = malloc(len + 5);
+    memcpy(w->path, name, len + 1);
+    snprintf(w->tmp_path, len + 5, "%s.tmp", name);
+    w->fd = open(w->tmp_path, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+    cap_t handle = w->fd == -1 ? 0 : qrt_cap_alloc();
+    if (!handle) {
+        if (w->fd != -1) {
+            close(w->fd);
+            unlink(w->tmp_path);
+        }
+        free(w->path);
+        free(w->tmp_path);
+        free(w);
+        return 0;
+    }
+    if (size_hint) {
+        // reserve the extent up front (falls back to nothing on failure).
+        posix_fallocate(w->fd, 0, (off_t) size_hint);
+    }
+    capinfo* c = qrt_cap(handle);
+    c->buf = w;
+    c->size = 0;
+    c->kind = CAP_KIND_WRITER;
+    return handle;
+}
+
+int Storage_Append(cap_t w_cap, const void* data, size_t len) {
+    storage_op* op = storage_writer_op(w_cap, STORAGE_OP_CHUNK, len);
+    if (!op) return -1;
+    memcpy(op->data, data, len);
+    storage_queue_op(op);
+    return 0;
+}
+
+static int storage_close_writer(cap_t w_cap, int kind, cap_t queue_cap, size_t tag) {
+    storage_op* op = storage_writer_op(w_cap, kind, 0);
+    if (!op) return -1;
+    op->queue_cap = queue_cap;
+    op->tag = tag;
+    if (queue_cap) qrt_queue(queue_cap); // create it here rather than on the writer thread
+    capinfo* c = qrt_cap(w_cap);
+    c->buf = 0;
+    c->kind = CAP_KIND_HEAP;
+    qrt_cap_release(w_cap);
+    storage_queue_op(op);
     return 0;
 }
 
+int Storage_CommitWriter(cap_t w_cap, cap_t queue_cap, size_t tag) {
+    return storage_close_writer(w_cap, STORAGE_OP_COMMIT, queue_cap, tag);
+}
+
+int Storage_AbortWriter(cap_t w_cap) {
+    return storage_close_writer(w_cap, STORAGE_OP_ABORT, 0, 0);
+}
+
 int Storage_DeleteObject(const char* name) {
     return -1;
 }
@@ -433,27 +2434,299 @@ int Storage_DeleteObject(const char* name) {
 
 // FRAMEBUFFER
 
-#define FB_SCALE 3
+// Row diff: find the span of 16-pixel chunks that changed since the last
+// frame. Returns 0 if the rows are identical.
+typedef int (*fb_diff_fn)(const uint8_t* a, const uint8_t* b, size_t width, size_t* first, size_t* last);
+
+static int fb_diff_row_c(const uint8_t* a, const uint8_t* b, size_t width, size_t* first, size_t* last) {
+    int found = 0;
+    for (size_t x=0; x<width; x+=16) {
+        size_t n = width - x < 16 ? width - x : 16;
+        if (memcmp(a+x, b+x, n)) {
+            if (!found) *first = x;
+            *last = x + n;
+            found = 1;
+        }
+    }
+    return found;
+}
 
-void FrameBuffer_Create(cap_t cap, FrameBuffer_Opts opts, size_t width, size_t height, size_t bpp, cap_t queue) {
-    fb_cap = cap;
-    fb_width = width;
-    fb_height = height;
-    fb_disp_width = width * FB_SCALE;
-    fb_disp_height = height * FB_SCALE;
-    window = SDL_CreateWindow(
-        "Framebuffer",
-        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        fb_disp_width, (int)(fb_disp_height * 1.2),
-        SDL_WINDOW_RESIZABLE
-    );
-    if (!window) {
-        printf("[RT] SDL_CreateWindow: %s\n", SDL_GetError());
+#ifdef QRT_X86
+
+__attribute__((target("sse2")))
+static int fb_diff_row_sse2(const uint8_t* a, const uint8_t* b, size_t width, size_t* first, size_t* last) {
+    int found = 0;
+    size_t x = 0;
+    for (; x+16 <= width; x+=16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+x)), _mm_loadu_si128((const __m128i*)(b+x)));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) {
+            if (!found) *first = x;
+            *last = x + 16;
+            found = 1;
+        }
+    }
+    if (x < width && memcmp(a+x, b+x, width-x)) {
+        if (!found) *first = x;
+        *last = width;
+        found = 1;
+    }
+    return found;
+}
+
+#endif
+
+static fb_expand_fn fb_expand_row = fb_expand_row_c;
+static fb_diff_fn fb_diff_row = fb_diff_row_c;
+
+static void fb_select_kernel(void) {
+#ifdef QRT_X86
+    if (SDL_HasAVX2()) {
+        fb_expand_row = fb_expand_row_avx2;
+    } else if (SDL_HasSSE2()) {
+        fb_expand_row = fb_expand_row_sse2;
+    }
+    if (SDL_HasSSE2()) {
+        fb_diff_row = fb_diff_row_sse2;
+    }
+#endif
+}
+
+#define FB_BAND_GAP 8 // clean rows merged into a dirty band (saves texture locks)
+#define FB_MAX_WORKERS 64
+#define FB_PAR_MIN_PIXELS 16384 // smaller bands are converted on the calling thread
+
+// A locked texture band to convert; split into 'parts' row ranges.
+typedef struct fb_jobS {
+    const uint8_t* src;
+    char* pixels;       // texture pixels for row y0, column x0
+    int pitch;
+    uint32_t y0, y1;    // source rows
+    size_t x0, x1;      // source columns
+    uint32_t parts;
+} fb_job;
+
+static fb_job fb_cur_job;
+static _Atomic uint32_t fb_job_seq;   // bumped to start a job (workers wait on it)
+static _Atomic uint32_t fb_job_left;  // workers yet to finish the job
+static _Atomic uint32_t fb_workers = 1; // threads converting a band, including the caller (FrameBuffer_SetWorkers)
+static uint32_t fb_threads = 0;       // pool threads started (they never exit)
+static uint32_t* fb_worker_rows[FB_MAX_WORKERS]; // expanded-row scratch per pool thread
+static uint32_t fb_worker_seq[FB_MAX_WORKERS];   // job sequence when each thread was started
+
+// expand each source row once, then copy it to fb_tex_scale texture rows;
+// the copies read from 'row', never from (possibly uncached) texture memory.
+static void fb_convert_part(const fb_job* job, uint32_t part, uint32_t* row) {
+    uint32_t rows = job->y1 - job->y0;
+    uint32_t y0 = job->y0 + rows * part / job->parts;
+    uint32_t y1 = job->y0 + rows * (part + 1) / job->parts;
+    size_t width = job->x1 - job->x0;
+    size_t row_bytes = width * fb_tex_scale * sizeof(uint32_t);
+    char* dst_row = job->pixels + (size_t)(y0 - job->y0) * fb_tex_scale * job->pitch; // pitch is in bytes
+    for (uint32_t y=y0; y<y1; y++) {
+        const uint8_t* from = job->src + y * fb_width + job->x0;
+        fb_expand_row(row, from, width, palette, fb_tex_scale);
+        for (uint32_t i=0; i<fb_tex_scale; i++) {
+            memcpy(dst_row, row, row_bytes);
+            dst_row += job->pitch;
+        }
+        memcpy(fb_prev + y * fb_width + job->x0, from, width);
+    }
+}
+
+static int fb_worker(void* arg) {
+    uint32_t id = (uint32_t)(uintptr_t) arg; // 1..fb_threads; the caller is part 0.
+    uint32_t seen = fb_worker_seq[id];
+    for (;;) {
+        uint32_t seq;
+        while ((seq = atomic_load_explicit(&fb_job_seq, memory_order_acquire)) == seen) {
+            qrt_futex_wait(&fb_job_seq, seen, -1);
+        }
+        seen = seq;
+        // every pool thread checks in, so the job can't be replaced under us.
+        if (id < fb_cur_job.parts) {
+            fb_convert_part(&fb_cur_job, id, fb_worker_rows[id]);
+        }
+        if (atomic_fetch_sub_explicit(&fb_job_left, 1, memory_order_acq_rel) == 1) {
+            qrt_futex_wake(&fb_job_left, 1);
+        }
+    }
+    return 0;
+}
+
+static void fb_alloc_worker_rows(void) {
+    for (uint32_t i=1; i<=fb_threads; i++) {
+        fb_worker_rows[i] = realloc(fb_worker_rows[i], fb_disp_width * sizeof(uint32_t));
+    }
+}
+
+static void fb_start_workers(void) {
+    // only called between jobs, so the pool is idle.
+    while (fb_threads + 1 < atomic_load_explicit(&fb_workers, memory_order_relaxed)) {
+        uint32_t id = fb_threads + 1;
+        fb_worker_rows[id] = realloc(fb_worker_rows[id], fb_disp_width * sizeof(uint32_t));
+        fb_worker_seq[id] = atomic_load_explicit(&fb_job_seq, memory_order_relaxed);
+        SDL_Thread* t = SDL_CreateThread(fb_worker, "fb-convert", (void*)(uintptr_t) id);
+        if (!t) {
+            printf("[RT] SDL_CreateThread: %s\n", SDL_GetError());
+            atomic_store_explicit(&fb_workers, fb_threads + 1, memory_order_relaxed);
+            return;
+        }
+        SDL_DetachThread(t);
+        fb_threads = id;
+    }
+}
+
+// Convert and upload source rows [y0,y1), columns [x0,x1) into the texture.
+static void fb_upload_band(const uint8_t* src_buf, uint32_t y0, uint32_t y1, size_t x0, size_t x1) {
+    fb_job* job = &fb_cur_job;
+    SDL_Rect rect = { x0 * fb_tex_scale, y0 * fb_tex_scale, (x1 - x0) * fb_tex_scale, (y1 - y0) * fb_tex_scale };
+    void* pixels;
+    if (fb_headless) {
+        job->pitch = fb_disp_width * sizeof(uint32_t);
+        pixels = fb_surface + (size_t)rect.y * fb_disp_width + rect.x;
+    } else if (SDL_LockTexture(texture, &rect, &pixels, &job->pitch) != 0) {
+        printf("[RT] SDL_LockTexture: %s\n", SDL_GetError());
         return;
     }
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED|SDL_RENDERER_PRESENTVSYNC); // SDL_RENDERER_SOFTWARE
-    if (!renderer) return;
-    // if (!SDL_RenderSetLogicalSize(renderer, width, height)) return 0;
+    job->src = src_buf;
+    job->pixels = pixels;
+    job->y0 = y0;
+    job->y1 = y1;
+    job->x0 = x0;
+    job->x1 = x1;
+    job->parts = 1;
+    if ((uint64_t)rect.w * rect.h >= FB_PAR_MIN_PIXELS) {
+        uint32_t workers = atomic_load_explicit(&fb_workers, memory_order_relaxed);
+        job->parts = workers < fb_threads + 1 ? workers : fb_threads + 1;
+        if (job->parts > y1 - y0) job->parts = y1 - y0;
+    }
+    if (job->parts > 1) {
+        // split into row bands across the pool, and join before unlocking.
+        atomic_store_explicit(&fb_job_left, fb_threads, memory_order_relaxed);
+        atomic_fetch_add_explicit(&fb_job_seq, 1, memory_order_release);
+        qrt_futex_wake(&fb_job_seq, INT32_MAX);
+        fb_convert_part(job, 0, fb_row);
+        uint32_t left;
+        while ((left = atomic_load_explicit(&fb_job_left, memory_order_acquire)) != 0) {
+            qrt_futex_wait(&fb_job_left, left, -1);
+        }
+    } else {
+        fb_convert_part(job, 0, fb_row);
+    }
+    if (!fb_headless) SDL_UnlockTexture(texture);
+    fb_stat_add(pixels_uploaded, (uint64_t)rect.w * rect.h);
+}
+
+// Frame buffer pool: one buffer per Frame event in flight, each owned by
+// either the pool, the App (between Frame event and Submit) or the runtime
+// (while converting), so a buffer is never handed out twice.
+#define FB_MAX_BUFFERS 3
+
+enum fb_buf_stateE {
+    FB_BUF_FREE = 0,
+    FB_BUF_APP = 1,
+    FB_BUF_BUSY = 2,
+};
+
+static cap_t fb_pool[FB_MAX_BUFFERS] = {0};
+static _Atomic uint32_t fb_pool_state[FB_MAX_BUFFERS];
+static uint32_t fb_pool_size = 0;
+static uint32_t fb_pool_next = 0; // round-robin start for the next hand-out
+static _Atomic uint32_t fb_app_holds = 0; // the App holds a buffer (or one is being handed out)
+
+static void fb_create_pool(uint32_t count, size_t size) {
+    for (uint32_t i=0; i<FB_MAX_BUFFERS; i++) {
+        if (fb_pool[i]) Buffer_Destroy(fb_pool[i]);
+        atomic_store(&fb_pool_state[i], FB_BUF_FREE);
+    }
+    for (uint32_t i=0; i<count; i++) {
+        if (!fb_pool[i]) fb_pool[i] = qrt_cap_alloc();
+        Buffer_Create(fb_pool[i], size, 0);
+    }
+    fb_pool_size = count;
+    fb_pool_next = 0;
+    atomic_store(&fb_app_holds, 0);
+}
+
+static int fb_pool_index(cap_t buf_cap) {
+    for (uint32_t i=0; i<fb_pool_size; i++) {
+        if (fb_pool[i] == buf_cap) return i;
+    }
+    return -1;
+}
+
+static int fb_pool_has_free(void) {
+    for (uint32_t i=0; i<fb_pool_size; i++) {
+        if (atomic_load(&fb_pool_state[i]) == FB_BUF_FREE) return 1;
+    }
+    return 0;
+}
+
+// Hand the next free buffer to the App in a Frame event, unless the App
+// already holds one. Called by Submit (App thread) and after conversion
+// (present thread), so only the caller that sets fb_app_holds hands out.
+static void fb_send_frame(void) {
+    do {
+        uint32_t expect = 0;
+        if (!atomic_compare_exchange_strong(&fb_app_holds, &expect, 1)) return;
+        for (uint32_t i=0; i<fb_pool_size; i++) {
+            uint32_t n = (fb_pool_next + i) % fb_pool_size;
+            expect = FB_BUF_FREE;
+            if (atomic_compare_exchange_strong(&fb_pool_state[n], &expect, FB_BUF_APP)) {
+                fb_pool_next = n + 1;
+                SDL_Event frame_event = {0};
+                frame_event.user.type = user_sdl_events+uev_fb_frame;
+                frame_event.user.data1 = (void*) fb_pool[n];
+                if (SDL_PushEvent(&frame_event) != 1) { // thread-safe
+                    printf("[RT] SDL_PushEvent (frame_event): %s\n", SDL_GetError());
+                    atomic_store(&fb_pool_state[n], FB_BUF_FREE);
+                    atomic_store(&fb_app_holds, 0);
+                }
+                return;
+            }
+        }
+        // all buffers are in use; a Frame is sent when one is released.
+        // Recheck after dropping the flag: a buffer released while we held
+        // it would otherwise never be handed out.
+        atomic_store(&fb_app_holds, 0);
+    } while (fb_pool_has_free());
+}
+
+// With NoSmooth or NoScaleUp (fb_tex_scale 1) the texture is uploaded at the
+// framebuffer's own size and the renderer scales it with nearest filtering.
+// Otherwise the CPU pre-scales by fb_scale, and the remaining stretch to the
+// window uses the scale quality hint as it was before the first texture
+// (SDL's default, nearest, unless the App set it).
+static int fb_quality_saved = 0;
+static char* fb_quality_default = 0; // SDL_HINT_RENDER_SCALE_QUALITY before we touched it
+
+static int fb_create_texture(void) {
+    if (texture) {
+        SDL_DestroyTexture(texture);
+        texture = 0;
+    }
+    fb_tex_scale = (fb_opts & (FrameBuffer_NoSmooth|FrameBuffer_NoScaleUp)) ? 1 : fb_scale;
+    fb_disp_width = fb_width * fb_tex_scale;
+    fb_disp_height = fb_height * fb_tex_scale;
+    fb_row = realloc(fb_row, fb_disp_width * sizeof(uint32_t));
+    fb_alloc_worker_rows();
+    fb_full_refresh = 1;
+    if (fb_headless) {
+        // convert into memory instead.
+        fb_surface = realloc(fb_surface, (size_t)fb_disp_width * fb_disp_height * sizeof(uint32_t));
+        return fb_surface != 0;
+    }
+    free(fb_surface); // left over from an earlier headless framebuffer
+    fb_surface = 0;
+    // applies to textures created after this point. A native-size texture is
+    // stretched by the renderer, so keep its pixels sharp; otherwise leave
+    // whatever filtering the App (or SDL's default) chose.
+    if (!fb_quality_saved) {
+        const char* q = SDL_GetHint(SDL_HINT_RENDER_SCALE_QUALITY);
+        fb_quality_default = q ? strdup(q) : 0;
+        fb_quality_saved = 1;
+    }
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, fb_tex_scale == 1 ? "nearest" : fb_quality_default);
     texture = SDL_CreateTexture(
         renderer,
         SDL_PIXELFORMAT_ARGB8888,
@@ -462,27 +2735,238 @@ void FrameBuffer_Create(cap_t cap, FrameBuffer_Opts opts, size_t width, size_t h
     );
     if (!texture) {
         printf("[RT] SDL_CreateTexture: %s\n", SDL_GetError());
+        return 0;
+    }
+    return 1;
+}
+
+// Palette and scale changes are applied by whichever thread owns the renderer,
+// just before it converts the next frame.
+static uint32_t fb_pending_palette[256] = {0};
+static SDL_SpinLock fb_palette_lock = 0;
+static _Atomic uint32_t fb_palette_dirty;
+static _Atomic uint32_t fb_scale_dirty;
+
+static void fb_apply_changes(void) {
+    if (atomic_exchange(&fb_palette_dirty, 0)) {
+        SDL_AtomicLock(&fb_palette_lock);
+        memcpy(palette, fb_pending_palette, 256*4);
+        SDL_AtomicUnlock(&fb_palette_lock);
+        fb_full_refresh = 1; // every pixel needs re-mapping
+    }
+    if (atomic_exchange(&fb_scale_dirty, 0)) {
+        fb_create_texture();
+    }
+    if (fb_threads + 1 < atomic_load_explicit(&fb_workers, memory_order_relaxed)) {
+        fb_start_workers();
+    }
+}
+
+// Convert the submitted buffer into the texture, then release the buffer
+// and, if the App has none, hand out the next one (before anyone waits on vsync).
+static void fb_convert_frame(int idx) {
+    uint8_t* src_buf = qrt_cap(fb_pool[idx])->buf; // submitted buffer
+    uint64_t t0 = SDL_GetPerformanceCounter();
+    fb_apply_changes();
+    // fill the texture (perform palette mapping)
+    // only rows that differ from the previous frame are converted, in bands
+    // spanning the changed columns; a palette change refreshes everything.
+    int full = fb_full_refresh, in_band = 0;
+    uint32_t band_y0 = 0, band_y1 = 0;
+    size_t band_x0 = 0, band_x1 = 0;
+    for (uint32_t y=0; y<=fb_height && (fb_headless ? fb_surface != 0 : texture != 0); y++) {
+        size_t first = 0, last = fb_width;
+        int dirty = 0;
+        if (y < fb_height) {
+            dirty = full || fb_diff_row(src_buf + y * fb_width, fb_prev + y * fb_width, fb_width, &first, &last);
+        }
+        if (dirty) {
+            if (!in_band) {
+                in_band = 1;
+                band_y0 = y;
+                band_x0 = first;
+                band_x1 = last;
+            } else {
+                if (first < band_x0) band_x0 = first;
+                if (last > band_x1) band_x1 = last;
+            }
+            band_y1 = y + 1;
+        } else if (in_band && (y == fb_height || y - band_y1 >= FB_BAND_GAP)) {
+            fb_upload_band(src_buf, band_y0, band_y1, band_x0, band_x1);
+            in_band = 0;
+        }
+    }
+    fb_full_refresh = 0;
+    fb_stat_add(convert_us, (SDL_GetPerformanceCounter() - t0) * 1000000 / SDL_GetPerformanceFrequency());
+    fb_stat_add(frames, 1);
+    fb_stat_add(pixels, (uint64_t)fb_disp_width * fb_disp_height);
+    atomic_store(&fb_pool_state[idx], FB_BUF_FREE);
+    fb_send_frame();
+}
+
+static void fb_dump_ppm(uint64_t frame) {
+    char path[300];
+    snprintf(path, sizeof(path), "%s%06llu.ppm", fb_dump_prefix, (unsigned long long) frame);
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        printf("[RT] FrameBuffer dump: cannot open %s\n", path);
         return;
     }
-    // allocate framebuffer storage buffer.
-    fb_buffer = next_cap++;
+    fprintf(f, "P6\n%u %u\n255\n", fb_disp_width, fb_disp_height);
+    uint8_t* rgb = (uint8_t*) fb_row; // 4 bytes per pixel; RGB fits in place
+    for (uint32_t y=0; y<fb_disp_height; y++) {
+        const uint32_t* from = fb_surface + (size_t)y * fb_disp_width;
+        for (uint32_t x=0; x<fb_disp_width; x++) {
+            rgb[x*3+0] = from[x] >> 16;
+            rgb[x*3+1] = from[x] >> 8;
+            rgb[x*3+2] = from[x];
+        }
+        fwrite(rgb, 3, fb_disp_width, f);
+    }
+    if (fclose(f) != 0) {
+        printf("[RT] FrameBuffer dump: error writing %s\n", path);
+    }
+}
+
+static void fb_present(uint64_t submitted) {
+    if (fb_headless) {
+        // headless: hand the converted frame to the capture hooks.
+        uint64_t frame = fb_stat_get(frames) - 1;
+        if (fb_capture_fn) {
+            fb_capture_fn(fb_capture_data, fb_surface, fb_disp_width, fb_disp_height, fb_disp_width * sizeof(uint32_t), frame);
+        }
+        if (fb_dump_every && frame % fb_dump_every == 0) {
+            fb_dump_ppm(frame);
+        }
+    } else {
+        // display the frame.
+        if (SDL_RenderClear(renderer) < 0) {
+            printf("[RT] SDL_RenderClear: %s\n", SDL_GetError());
+        }
+        if (SDL_RenderCopy(renderer, texture, NULL, NULL) < 0) {
+            printf("[RT] SDL_RenderCopy: %s\n", SDL_GetError());
+        }
+        SDL_RenderPresent(renderer);
+    }
+    // latency from Submit to the end of the present.
+    uint32_t us = (uint32_t)((SDL_GetPerformanceCounter() - submitted) * 1000000 / SDL_GetPerformanceFrequency());
+    fb_stat_add(latency_us, us);
+    atomic_store_explicit(&fb_stats.latency_last_us, us, memory_order_relaxed);
+    if (us > fb_stat_get(latency_max_us)) atomic_store_explicit(&fb_stats.latency_max_us, us, memory_order_relaxed);
+}
+
+static int fb_open_renderer(void) {
+    if (fb_headless) {
+        return fb_create_texture(); // headless
+    }
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED|SDL_RENDERER_PRESENTVSYNC); // SDL_RENDERER_SOFTWARE
+    if (!renderer) {
+        printf("[RT] SDL_CreateRenderer: %s\n", SDL_GetError());
+        return 0;
+    }
+    // if (!SDL_RenderSetLogicalSize(renderer, width, height)) return 0;
+    return fb_create_texture();
+}
+
+// AsyncPresent: a present thread owns the renderer. Submit pushes the buffer
+// index onto a small ring (at most one entry per pool buffer) and returns.
+#define FB_SUBMIT_RING 4 // power of two, > FB_MAX_BUFFERS
+
+static SDL_Thread* fb_present_thread = 0;
+static _Atomic uint32_t fb_present_state;  // 0 = starting, 1 = running, 2 = failed
+static _Atomic uint32_t fb_present_quit;
+static _Atomic uint32_t fb_submit_head;    // written by Submit
+static uint32_t fb_submit_tail = 0;        // present thread only
+static uint32_t fb_submit_ring[FB_SUBMIT_RING];
+static uint64_t fb_submit_time[FB_MAX_BUFFERS];
+
+static int fb_present_main(void* arg) {
+    uint32_t ok = fb_open_renderer();
+    atomic_store(&fb_present_state, ok ? 1 : 2);
+    qrt_futex_wake(&fb_present_state, 1);
+    if (!ok) return 0;
+    for (;;) {
+        uint32_t head;
+        while ((head = atomic_load_explicit(&fb_submit_head, memory_order_acquire)) == fb_submit_tail) {
+            if (atomic_load(&fb_present_quit)) return 0;
+            qrt_futex_wait(&fb_submit_head, head, -1);
+        }
+        int idx = fb_submit_ring[fb_submit_tail % FB_SUBMIT_RING];
+        fb_submit_tail++;
+        uint64_t submitted = fb_submit_time[idx];
+        fb_convert_frame(idx);
+        fb_present(submitted);
+    }
+}
+
+static void fb_stop_present(void) {
+    if (fb_present_thread) {
+        atomic_store(&fb_present_quit, 1);
+        qrt_futex_wake(&fb_submit_head, 1);
+        SDL_WaitThread(fb_present_thread, NULL);
+        fb_present_thread = 0;
+        atomic_store(&fb_present_quit, 0);
+    }
+}
+
+void FrameBuffer_Create(cap_t cap, FrameBuffer_Opts opts, size_t width, size_t height, size_t bpp, cap_t queue) {
+    fb_stop_present();
+    fb_cap = cap;
+    if (queue) svc_queue = queue;
+    fb_opts = opts;
+    fb_width = width;
+    fb_height = height;
+    int headless = qrt_headless || (opts & FrameBuffer_Headless);
+    fb_headless = headless;
+    uint32_t win_scale = (opts & FrameBuffer_NoScaleUp) ? 1 : fb_scale;
+    if (!headless) {
+        window = SDL_CreateWindow(
+            "Framebuffer",
+            SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+            width * win_scale, (int)(height * win_scale * 1.2),
+            SDL_WINDOW_RESIZABLE
+        );
+        if (!window) {
+            printf("[RT] SDL_CreateWindow: %s\n", SDL_GetError());
+            return;
+        }
+    }
+    fb_select_kernel();
+    // allocate framebuffer storage buffers.
     size_t sz = fb_width * fb_height;
-    Buffer_Create(fb_buffer, sz, 0);
+    fb_create_pool((opts & FrameBuffer_TripleBuffer) ? 3 : (opts & FrameBuffer_DoubleBuffer) ? 2 : 1, sz);
+    fb_prev = realloc(fb_prev, sz);
+    fb_full_refresh = 1;
+    if (opts & FrameBuffer_AsyncPresent) {
+        // the renderer is created on (and only used by) the present thread.
+        atomic_store(&fb_present_state, 0);
+        fb_submit_tail = atomic_load(&fb_submit_head);
+        fb_present_thread = SDL_CreateThread(fb_present_main, "fb-present", NULL);
+        if (!fb_present_thread) {
+            printf("[RT] SDL_CreateThread: %s\n", SDL_GetError());
+            return;
+        }
+        uint32_t state;
+        while ((state = atomic_load(&fb_present_state)) == 0) {
+            qrt_futex_wait(&fb_present_state, 0, -1);
+        }
+        if (state != 1) return;
+    } else {
+        if (!fb_open_renderer()) return;
+    }
     // Must be set here, after window creation.
     // We aren't receiving SDL_WINDOWEVENT_FOCUS_GAINED or SDL_WINDOWEVENT_ENTER
     // right now, but previously found setting it there triggered the warp fallback.
-    SDL_SetRelativeMouseMode(SDL_TRUE);
-    ptr_relative = 1;
-    // send one Frame event.
-    SDL_Event frame_event = {0};
-    frame_event.user.type = user_sdl_events+uev_fb_frame;
-    frame_event.user.data1 = (void*) fb_buffer;
-    if (SDL_PushEvent(&frame_event) != 1) { // thread-safe
-	printf("[RT] SDL_PushEvent (frame_event): %s\n", SDL_GetError());
+    if (!headless) {
+        SDL_SetRelativeMouseMode(SDL_TRUE);
+        ptr_relative = 1;
     }
+    // send one Frame event.
+    fb_send_frame();
 }
 
 void FrameBuffer_Configure(cap_t fb_cap, FrameBuffer_Opts opts, size_t width, size_t height, size_t bpp, cap_t queue_cap) {
+        if (!window) return;
         if (opts & FrameBuffer_Fullscreen) {
                 if (!fb_fullscreen) {
                         fb_fullscreen = 1;
@@ -497,146 +2981,741 @@ void FrameBuffer_Configure(cap_t fb_cap, FrameBuffer_Opts opts, size_t width, si
 }
 
 void FrameBuffer_SetTitle(cap_t fb_cap, const char* title) {
-        SDL_SetWindowTitle(window, title);
+        if (window) SDL_SetWindowTitle(window, title);
 }
 
 void FrameBuffer_SetFullscreen(cap_t fb_cap, int fullscreen) {
-        if (fb_fullscreen != !!fullscreen) {
+        if (window && fb_fullscreen != !!fullscreen) {
                 SDL_SetWindowFullscreen(window, fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
                 fb_fullscreen = !!fullscreen;
         }
 }
 
+void FrameBuffer_SetScale(cap_t fb_cap, size_t scale) {
+        fb_scale = scale < 1 ? 1 : scale;
+        if (window && !(fb_opts & FrameBuffer_NoScaleUp)) {
+                SDL_SetWindowSize(window, fb_width * fb_scale, (int)(fb_height * fb_scale * 1.2));
+        }
+        // the texture is re-created before the next frame is converted.
+        atomic_store(&fb_scale_dirty, 1);
+}
+
 void FrameBuffer_SetPalette(cap_t fb_cap, cap_t buf_cap) {
-    uint32_t* pal = caps[buf_cap].buf;
-    if (caps[buf_cap].size == 256*4) {
-        memcpy(palette, pal, 256*4);
+    uint32_t* pal = qrt_cap(buf_cap)->buf;
+    if (qrt_cap(buf_cap)->size == 256*4) {
+        SDL_AtomicLock(&fb_palette_lock);
+        if (memcmp(fb_pending_palette, pal, 256*4)) {
+            memcpy(fb_pending_palette, pal, 256*4);
+            atomic_store(&fb_palette_dirty, 1);
+        }
+        SDL_AtomicUnlock(&fb_palette_lock);
+    }
+}
+
+void FrameBuffer_SetCapture(cap_t fb_cap, FrameBuffer_CaptureCallback callback, void* userdata) {
+    fb_capture_fn = callback;
+    fb_capture_data = userdata;
+}
+
+void FrameBuffer_SetCaptureDump(cap_t fb_cap, const char* path_prefix, size_t every_n) {
+    snprintf(fb_dump_prefix, sizeof(fb_dump_prefix), "%s", path_prefix ? path_prefix : "");
+    fb_dump_every = path_prefix ? every_n : 0;
+}
+
+void FrameBuffer_GetStats(cap_t fb_cap, FrameBuffer_Stats* stats) {
+    stats->frames = fb_stat_get(frames);
+    stats->pixels = fb_stat_get(pixels);
+    stats->pixels_uploaded = fb_stat_get(pixels_uploaded);
+    stats->convert_us = fb_stat_get(convert_us);
+    stats->latency_us = fb_stat_get(latency_us);
+    stats->latency_last_us = fb_stat_get(latency_last_us);
+    stats->latency_max_us = fb_stat_get(latency_max_us);
+}
+
+void FrameBuffer_SetWorkers(cap_t fb_cap, size_t workers) {
+    if (workers < 1) workers = 1;
+    if (workers > FB_MAX_WORKERS) workers = FB_MAX_WORKERS;
+    atomic_store_explicit(&fb_workers, workers, memory_order_relaxed);
+    if (!fb_present_thread) {
+        fb_start_workers();
     }
+    // with AsyncPresent, the present thread starts them before its next frame.
 }
 
 void FrameBuffer_Submit(cap_t fb_cap, cap_t buf_cap) {
-    void* pixels;
-    int pitch;
-    if (SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0) {
-        printf("[RT] SDL_LockTexture: %s\n", SDL_GetError());
+    int idx = fb_pool_index(buf_cap);
+    uint32_t expect = FB_BUF_APP;
+    if (idx < 0 || !atomic_compare_exchange_strong(&fb_pool_state[idx], &expect, FB_BUF_BUSY)) {
+        printf("[RT] FrameBuffer_Submit: buffer %d was not handed out in a Frame event\n", (int)buf_cap);
         return;
     }
-    // fill the texture (perform palette mapping)
-    uint8_t* src_buf = caps[buf_cap].buf; // submitted buffer
-    uint32_t row_ofs = 0, col_ofs = 0, one_step = 65536/FB_SCALE;
-    if (!src_buf) return;
-    char* dst_row = pixels; // pitch is in bytes
-    for (int y=0; y<fb_disp_height; y++) {
-        // first WINDOW row
-        uint32_t* to = (uint32_t*)dst_row;
-        uint8_t* from = src_buf + (row_ofs>>16) * fb_width;
-        for (int x=0; x<fb_disp_width; x++) {
-            *to++ = palette[from[col_ofs>>16]];
-            col_ofs += one_step;
-        }
-        dst_row += pitch;
-        row_ofs += one_step;
-        col_ofs = 0;
-    }
-    // display the frame.
-    SDL_UnlockTexture(texture);
-    if (SDL_RenderClear(renderer) < 0) {
-        printf("[RT] SDL_RenderClear: %s\n", SDL_GetError());
-    }
-    if (SDL_RenderCopy(renderer, texture, NULL, NULL) < 0) {
-        printf("[RT] SDL_RenderCopy: %s\n", SDL_GetError());
+    if (!qrt_cap(buf_cap)->buf || !fb_prev || !(fb_headless ? fb_surface != 0 : texture != 0)) {
+        atomic_store(&fb_pool_state[idx], FB_BUF_APP);
+        return;
     }
-    // HACK: You may only call this function on the main thread.
-    SDL_RenderPresent(renderer);
-    // send a new frame event.
-    SDL_Event frame_event = {0};
-    frame_event.user.type = user_sdl_events+uev_fb_frame;
-    frame_event.user.data1 = (void*) fb_buffer;
-    if (SDL_PushEvent(&frame_event) != 1) { // thread-safe
-	printf("[RT] SDL_PushEvent (frame_event): %s\n", SDL_GetError());
+    fb_submit_time[idx] = SDL_GetPerformanceCounter();
+    atomic_store(&fb_app_holds, 0);
+    if (fb_present_thread) {
+        uint32_t head = atomic_load_explicit(&fb_submit_head, memory_order_relaxed);
+        fb_submit_ring[head % FB_SUBMIT_RING] = idx;
+        atomic_store_explicit(&fb_submit_head, head + 1, memory_order_release);
+        qrt_futex_wake(&fb_submit_head, 1);
+        // hand out another buffer now, so the App renders the next frame
+        // while this one converts and presents.
+        fb_send_frame();
+        return;
     }
+    fb_convert_frame(idx);
+    // HACK: You may only call this function on the main thread.
+    fb_present(fb_submit_time[idx]);
 }
 
 
 // AUDIO
 
-// According to some libsdl forum posts, SDL_OpenAudioDevice has an undocumented
-// limitation: you can only have one callback attached to each device; in other
-// words, you only get one audio stream per device.
+// SDL allows only one callback per device, so the runtime opens a single
+// device (with the spec of the first audio cap) and mixes every audio cap
+// into it: push-mode caps from their rings, pull-mode caps through their
+// callbacks. Each cap has its own gain; voices are summed with saturating
+// adds, so a loud mix clips instead of wrapping.
+
+// Caps may use any Audio_Opts sample format and their own rate. The mixer
+// converts each chunk to S16 and, if the rates differ, runs it through a
+// polyphase filter: linear interpolation or a windowed sinc, by quality.
+
+// Push mode: Audio_Submit copies each chunk once, into a ring that the
+// mixer drains directly; neither side blocks or takes a lock.
+// Whenever the ring holds less than the latency target, the mixer flags the
+// voice, and the audio-refill thread posts an Audio_FrameEvent (one at a
+// time) asking the App for more: posting takes the queue's producer lock
+// and may push SDL events, which the audio thread must not wait on.
+
+#define AUDIO_MAX_VOICES 512
+#define AUDIO_RING_CHUNKS 8      // ring capacity, in device chunks
+#define AUDIO_LATENCY_CHUNKS 2   // default latency target
+#define AUDIO_GAIN_SHIFT 12      // gains are 4.12 fixed point
+#define AUDIO_GAIN_UNITY (1 << AUDIO_GAIN_SHIFT)
+#define AUDIO_PHASE_BITS 8       // filter phases per input frame (nearest is used)
+#define AUDIO_PHASES (1 << AUDIO_PHASE_BITS)
+#define AUDIO_COEF_SHIFT 14      // filter taps are 2.14 fixed point
+#define AUDIO_MAX_RATIO 8        // between a cap's rate and the device's
+#define AUDIO_COMMANDS 256       // command channel slots (pull mode), power of two
+
+typedef struct qrt_resamplerS {
+    uint64_t pos;                // 32.32 input frames from hist[0] to the next output
+    uint64_t step;               // 32.32 input frames per output frame
+    uint32_t taps;
+    int interp;                  // blend neighbouring phases (best quality)
+    uint32_t len;                // frames in hist
+    uint32_t size;               // frames hist can hold, per channel
+    int16_t* coef;               // AUDIO_PHASES + 1 rows of taps
+    int16_t* hist;               // planar: one run of 'size' per channel
+} qrt_resampler;
+
+typedef struct qrt_audioS {
+    // producer (Audio_Submit, Audio_PostCommand) cache line.
+    _Atomic uint32_t write;      // free-running byte counters
+    _Atomic uint32_t cmd_write;  // free-running command counters
+    _Atomic uint64_t cmd_dropped;
+    uint8_t pad_w[48];
+    // consumer (mixer) cache line.
+    _Atomic uint32_t read;
+    _Atomic uint32_t refill;     // audio_refill_stateE
+    _Atomic uint32_t refill_fill; // ring fill when the mixer asked, bytes
+    _Atomic uint32_t cmd_read;
+    _Atomic uint64_t cmd_read_total;
+    _Atomic uint64_t cmd_late;
+    _Atomic uint64_t frames;     // input frames taken before the current chunk
+    uint64_t chunk_end;          // ... and after it
+    uint8_t pad_r[16];
+    _Atomic uint32_t target;     // latency target, bytes
+    _Atomic uint32_t gain;
+    _Atomic uint32_t playing;
+    Audio_StreamCallback callback; // pull mode; push mode uses the ring
+    Audio_Command* cmds;         // pull mode: AUDIO_COMMANDS slots
+    uint8_t* ring;
+    uint32_t ring_mask;
+    uint32_t channels;
+    uint32_t format;             // Audio_Fmt_*
+    uint32_t frame_bytes;        // one sample for every channel
+    uint32_t chunk_bytes;        // input for one device callback (nominal)
+    uint32_t rate;
+    int idle;                    // the last chunk had no input
+    Audio_Quality quality;
+    qrt_resampler* rs;           // if the rate differs; swapped under the device lock
+    uint8_t* raw;                // one chunk of input, as the App supplies it
+    int16_t* pcm;                // ... converted to S16
+    cap_t cap;
+    cap_t queue;
+    cap_t stage;                 // chunk-sized buffer named in refill events
+} qrt_audio;
+
+enum audio_refill_stateE {
+    AUDIO_REFILL_IDLE = 0,
+    AUDIO_REFILL_WANTED = 1,     // set by the mixer
+    AUDIO_REFILL_POSTED = 2,     // an Audio_FrameEvent is outstanding
+};
 
-void Audio_Create(cap_t au_cap, cap_t s_queue, Audio_Opts opts, size_t channels, size_t sample_rate, size_t samples_per_chunk) {
-    snd_queue = s_queue;
-    snd_playing = 0;
-    // static SDL_AudioStream* snd_stream = 0;
-    // snd_stream = SDL_NewAudioStream(AUDIO_S16, channels, sample_rate, );
-    SDL_AudioSpec spec = {0};
-    // SDL_AudioSpec obtained = {0};
-    spec.freq = sample_rate;
-    spec.format = AUDIO_S16;
-    spec.channels = channels;
-    // "This number should be a power of two":
-    // measured in sample-frames (groups of samples for all channels)
-    spec.samples = samples_per_chunk; // XXX doom passes 512, but we should send back a msg with actual size?
-    if (SDL_OpenAudio(&spec, NULL) < 0) {
-        printf("[RT] SDL_OpenAudioDevice: %s\n", SDL_GetError());
-        return;
+static qrt_audio* snd_voices[AUDIO_MAX_VOICES]; // changed under the device lock
+static int snd_voice_count = 0;
+static _Atomic uint32_t snd_refill_wanted = 0;  // futex: some voice is AUDIO_REFILL_WANTED
+static SDL_AudioSpec snd_spec = {0};  // what the device accepted
+static int16_t* snd_scratch = 0;      // one voice's chunk, at the device channel count
+
+static void audio_free(void* audio) {
+    qrt_audio* a = audio;
+    if (!a) return;
+    if (a->stage) {
+        Buffer_Destroy(a->stage);
+        qrt_cap_release(a->stage);
     }
-    snd_device = 1; // SDL_OpenAudio always sets up device 1.
+    free(a->cmds);
+    free(a->rs);
+    free(a->raw);
+    free(a->pcm);
+    free(a->ring);
+    free(a);
 }
 
-void Audio_Submit(cap_t au_cap, cap_t buf_cap) {
-    // XXX push model: queue more audio whenever DOOM supplies it.
-    // XXX will move to a timer + SDL_GetQueuedAudioSize later, on a different task?
-    // this function copies the data!
-    if (snd_device) {
-        if (SDL_QueueAudio(snd_device, Buffer_Address(buf_cap), Buffer_Size(buf_cap)) < 0) {
-            printf("[RT] SDL_QueueAudio: %s\n", SDL_GetError());
+// Runs on the audio thread: only flags the voice and wakes the refill
+// thread, which posts the event. No locks, no waiting.
+static void audio_request_refill(qrt_audio* a, uint32_t fill) {
+    uint32_t idle = AUDIO_REFILL_IDLE;
+    if (!a->queue || atomic_load_explicit(&a->refill, memory_order_relaxed) != idle) return;
+    atomic_store_explicit(&a->refill_fill, fill, memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&a->refill, &idle, AUDIO_REFILL_WANTED, memory_order_release, memory_order_relaxed)) return;
+    atomic_store_explicit(&snd_refill_wanted, 1, memory_order_release);
+    qrt_futex_wake(&snd_refill_wanted, 1);
+}
+
+// Post an Audio_FrameEvent for every voice the mixer flagged. Events are
+// built under the device lock (so voices can't be freed meanwhile) and
+// posted after it, so the mixer never waits on a queue's producer lock.
+static void audio_post_refills(void) {
+    static struct { qrt_audio* a; cap_t queue; Audio_FrameEvent ev; } posts[AUDIO_MAX_VOICES];
+    int n = 0;
+    SDL_LockAudioDevice(snd_device);
+    for (int i = 0; i < snd_voice_count; i++) {
+        qrt_audio* a = snd_voices[i];
+        uint32_t wanted = AUDIO_REFILL_WANTED;
+        if (!atomic_compare_exchange_strong_explicit(&a->refill, &wanted, AUDIO_REFILL_POSTED, memory_order_acquire, memory_order_relaxed)) continue;
+        Audio_FrameEvent* ev = &posts[n].ev;
+        memset(ev, 0, sizeof(*ev));
+        ev->h.cap = a->cap;
+        ev->h.size = sizeof(Audio_FrameEvent);
+        ev->h.event = Audio_Frame;
+        ev->dt_ms = (size_t) atomic_load_explicit(&a->refill_fill, memory_order_relaxed) * 1000 / ((size_t) a->frame_bytes * a->rate);
+        ev->buf_cap = a->stage;
+        posts[n].a = a;
+        posts[n].queue = a->queue;
+        n++;
+    }
+    SDL_UnlockAudioDevice(snd_device);
+    for (int i = 0; i < n; i++) {
+        if (!qrt_queue_post(qrt_cap(posts[i].queue)->buf, &posts[i].ev.h)) {
+            // full: the next callback asks again, if the voice still exists.
+            SDL_LockAudioDevice(snd_device);
+            for (int j = 0; j < snd_voice_count; j++) {
+                if (snd_voices[j] != posts[i].a) continue;
+                uint32_t posted = AUDIO_REFILL_POSTED;
+                atomic_compare_exchange_strong(&posts[i].a->refill, &posted, AUDIO_REFILL_IDLE);
+                break;
+            }
+            SDL_UnlockAudioDevice(snd_device);
         }
-        if (!snd_playing) {
-            SDL_PauseAudioDevice(snd_device, 0);
-            snd_playing = 1;
+    }
+}
+
+static int audio_refill_main(void* unused) {
+    for (;;) {
+        qrt_futex_wait(&snd_refill_wanted, 0, -1);
+        if (!atomic_exchange_explicit(&snd_refill_wanted, 0, memory_order_acquire)) continue;
+        if (snd_device) audio_post_refills();
+    }
+    return 0;
+}
+
+// Take up to 'len' bytes from a push-mode ring; returns the bytes taken.
+static uint32_t audio_ring_read(qrt_audio* a, uint8_t* out, uint32_t len) {
+    uint32_t r = atomic_load_explicit(&a->read, memory_order_relaxed);
+    uint32_t fill = atomic_load_explicit(&a->write, memory_order_acquire) - r;
+    uint32_t n = fill < len ? fill : len;
+    uint32_t ofs = r & a->ring_mask;
+    uint32_t first = a->ring_mask + 1 - ofs;
+    if (first > n) first = n;
+    memcpy(out, a->ring + ofs, first);
+    memcpy(out + first, a->ring, n - first);
+    if (n < len) memset(out + n, 0, len - n); // underrun
+    atomic_store_explicit(&a->read, r + n, memory_order_release);
+    if (fill - n < atomic_load_explicit(&a->target, memory_order_relaxed)) {
+        audio_request_refill(a, fill - n);
+    }
+    return n;
+}
+
+static inline int16_t audio_sat16(int32_t v) {
+    return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+}
+
+// mix += in * gain, saturating (n samples).
+static void audio_mix_s16(int16_t* mix, const int16_t* in, size_t n, uint32_t gain) {
+    size_t i = 0;
+#ifdef QRT_X86
+    if (gain == AUDIO_GAIN_UNITY) {
+        for (; i + 8 <= n; i += 8) {
+            __m128i m = _mm_loadu_si128((const __m128i*)(mix + i));
+            __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+            _mm_storeu_si128((__m128i*)(mix + i), _mm_adds_epi16(m, v));
         }
+    } else {
+        __m128i g = _mm_set1_epi16((int16_t) gain);
+        for (; i + 8 <= n; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+            // full 32-bit products, scaled back and packed with saturation.
+            __m128i lo = _mm_mullo_epi16(v, g);
+            __m128i hi = _mm_mulhi_epi16(v, g);
+            __m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), AUDIO_GAIN_SHIFT);
+            __m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), AUDIO_GAIN_SHIFT);
+            __m128i m = _mm_loadu_si128((const __m128i*)(mix + i));
+            _mm_storeu_si128((__m128i*)(mix + i), _mm_adds_epi16(m, _mm_packs_epi32(p0, p1)));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        int16_t v = audio_sat16((in[i] * (int32_t) gain) >> AUDIO_GAIN_SHIFT);
+        mix[i] = audio_sat16(mix[i] + v);
+    }
+}
+
+static uint32_t audio_sample_bytes(uint32_t format) {
+    switch (format) {
+        case Audio_Fmt_U8: return 1;
+        case Audio_Fmt_S24: return 3;
+        case Audio_Fmt_S32: return 4;
+        default: return 2;
+    }
+}
+
+// n samples of 'format' to S16.
+static void audio_to_s16(int16_t* out, const uint8_t* in, size_t n, uint32_t format) {
+    size_t i = 0;
+    switch (format) {
+        case Audio_Fmt_U8: {
+#ifdef QRT_X86
+            __m128i zero = _mm_setzero_si128();
+            __m128i bias = _mm_set1_epi16(128);
+            for (; i + 16 <= n; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+                __m128i lo = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias), 8);
+                __m128i hi = _mm_slli_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias), 8);
+                _mm_storeu_si128((__m128i*)(out + i), lo);
+                _mm_storeu_si128((__m128i*)(out + i + 8), hi);
+            }
+#endif
+            for (; i < n; i++) out[i] = (int16_t)((in[i] - 128) * 256);
+            break;
+        }
+        case Audio_Fmt_S24: {
+            // packed little-endian; keep the top 16 bits.
+            for (; i < n; i++) out[i] = (int16_t)(in[3*i + 1] | in[3*i + 2] << 8);
+            break;
+        }
+        case Audio_Fmt_S32: {
+            const int32_t* s = (const int32_t*) in;
+#ifdef QRT_X86
+            for (; i + 8 <= n; i += 8) {
+                __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s + i)), 16);
+                __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s + i + 4)), 16);
+                _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(a, b));
+            }
+#endif
+            for (; i < n; i++) out[i] = (int16_t)(s[i] >> 16);
+            break;
+        }
+        default:
+            memcpy(out, in, n * sizeof(int16_t));
+    }
+}
+
+static qrt_resampler* audio_resampler_new(uint32_t rate_in, uint32_t rate_out, uint32_t channels, Audio_Quality quality, uint32_t max_out) {
+    uint32_t taps = quality == Audio_QualityFast ? 2 : quality == Audio_QualityBest ? 32 : 16;
+    uint64_t step = ((uint64_t) rate_in << 32) / rate_out;
+    uint32_t size = (uint32_t)((max_out * step) >> 32) + taps + 2;
+    qrt_resampler* rs = calloc(1, sizeof(qrt_resampler) + ((AUDIO_PHASES + 1) * taps + channels * size) * sizeof(int16_t));
+    rs->coef = (int16_t*)(rs + 1);
+    rs->hist = rs->coef + (AUDIO_PHASES + 1) * taps;
+    rs->step = step;
+    rs->taps = taps;
+    rs->interp = quality == Audio_QualityBest;
+    rs->size = size;
+    rs->len = taps - 1; // silence before the first frame
+    // below the output's Nyquist rate when downsampling (with a margin for the window).
+    double cutoff = rate_out < rate_in ? (double) rate_out / rate_in : 1.0;
+    if (taps > 2) cutoff *= 0.95;
+    double w[32];
+    for (uint32_t p = 0; p <= AUDIO_PHASES; p++) { // the last row is the next frame's phase 0
+        double sum = 0;
+        for (uint32_t k = 0; k < taps; k++) {
+            // distance from the output instant to input frame k.
+            double x = (double) p / AUDIO_PHASES + taps/2 - 1 - (double) k;
+            if (taps == 2) {
+                w[k] = 1 - (x < 0 ? -x : x);
+            } else {
+                double y = M_PI * cutoff * x;
+                double sinc = y == 0 ? 1 : SDL_sin(y) / y;
+                double n = 2 * M_PI * (x + taps/2) / taps; // Blackman window
+                w[k] = sinc * (0.42 - 0.5 * SDL_cos(n) + 0.08 * SDL_cos(2 * n));
+            }
+            sum += w[k];
+        }
+        for (uint32_t k = 0; k < taps; k++) {
+            rs->coef[p*taps + k] = (int16_t)(w[k] / sum * (1 << AUDIO_COEF_SHIFT) + (w[k] < 0 ? -0.5 : 0.5));
+        }
+    }
+    return rs;
+}
+
+static inline int16_t audio_dot(const int16_t* x, const int16_t* h, uint32_t taps) {
+    int32_t acc = 0;
+    uint32_t k = 0;
+#ifdef QRT_X86
+    if (!(taps & 7)) {
+        __m128i s = _mm_setzero_si128();
+        for (; k < taps; k += 8) {
+            s = _mm_add_epi32(s, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(x + k)), _mm_loadu_si128((const __m128i*)(h + k))));
+        }
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+        acc = _mm_cvtsi128_si32(s);
+    }
+#endif
+    for (; k < taps; k++) acc += x[k] * h[k];
+    return audio_sat16((acc + (1 << (AUDIO_COEF_SHIFT - 1))) >> AUDIO_COEF_SHIFT);
+}
+
+// Input frames to append before the next 'frames' outputs.
+static uint32_t audio_resample_need(qrt_resampler* rs, size_t frames) {
+    uint32_t need = (uint32_t)((rs->pos + frames * rs->step) >> 32) + rs->taps;
+    return need > rs->len ? need - rs->len : 0;
+}
+
+// Append interleaved input, then produce 'frames' interleaved outputs.
+static void audio_resample(qrt_resampler* rs, int16_t* out, size_t frames, const int16_t* in, uint32_t in_frames, uint32_t channels) {
+    for (uint32_t c = 0; c < channels; c++) {
+        int16_t* h = rs->hist + c * rs->size + rs->len;
+        for (uint32_t i = 0; i < in_frames; i++) h[i] = in[i*channels + c];
+    }
+    rs->len += in_frames;
+    uint64_t pos = rs->pos;
+    for (size_t f = 0; f < frames; f++) {
+        uint32_t i = (uint32_t)(pos >> 32);
+        const int16_t* coef = rs->coef + ((pos >> (32 - AUDIO_PHASE_BITS)) & (AUDIO_PHASES - 1)) * rs->taps;
+        for (uint32_t c = 0; c < channels; c++) {
+            const int16_t* x = rs->hist + c * rs->size + i;
+            int32_t v = audio_dot(x, coef, rs->taps);
+            if (rs->interp) {
+                int32_t frac = (pos >> (32 - AUDIO_PHASE_BITS - 15)) & 0x7FFF;
+                v += ((audio_dot(x, coef + rs->taps, rs->taps) - v) * frac) >> 15;
+            }
+            out[f*channels + c] = (int16_t) v;
+        }
+        pos += rs->step;
+    }
+    // drop the frames no later output can reach.
+    uint32_t used = (uint32_t)(pos >> 32);
+    rs->len -= used;
+    for (uint32_t c = 0; c < channels; c++) {
+        memmove(rs->hist + c * rs->size, rs->hist + c * rs->size + used, rs->len * sizeof(int16_t));
+    }
+    rs->pos = pos & 0xFFFFFFFFu;
+}
+
+// Mono to the device channel count, in place.
+static void audio_upmix(int16_t* buf, size_t frames, uint32_t channels) {
+    for (size_t i = frames; i-- > 0;) {
+        int16_t v = buf[i];
+        for (uint32_t c = 0; c < channels; c++) buf[i*channels + c] = v;
     }
 }
 
+// One chunk of a voice into snd_scratch (S16, device rate, the voice's
+// channels); returns 0 if there is nothing to mix.
+static int audio_render(qrt_audio* a, size_t frames) {
+    qrt_resampler* rs = a->rs;
+    uint32_t in_frames = rs ? audio_resample_need(rs, frames) : frames;
+    uint32_t bytes = in_frames * a->frame_bytes;
+    // S16 at the device rate goes straight to the scratch chunk.
+    uint8_t* raw = rs || a->format != Audio_Fmt_S16 ? a->raw : (uint8_t*) snd_scratch;
+    if (a->callback) {
+        // commands up to the end of this chunk become readable.
+        a->chunk_end = atomic_load_explicit(&a->frames, memory_order_relaxed) + in_frames;
+        if (bytes) a->callback(0, raw, bytes);
+        atomic_store_explicit(&a->frames, a->chunk_end, memory_order_relaxed);
+    } else if (bytes) {
+        int got = audio_ring_read(a, raw, bytes) != 0;
+        if (!got && a->idle) return 0; // still nothing queued
+        a->idle = !got;
+    }
+    if (!rs) {
+        if (raw != (uint8_t*) snd_scratch) audio_to_s16(snd_scratch, raw, frames * a->channels, a->format);
+        return 1;
+    }
+    const int16_t* pcm = (const int16_t*) raw;
+    if (a->format != Audio_Fmt_S16) {
+        audio_to_s16(a->pcm, raw, in_frames * a->channels, a->format);
+        pcm = a->pcm;
+    }
+    audio_resample(rs, snd_scratch, frames, pcm, in_frames, a->channels);
+    return 1;
+}
+
+static void SDLCALL audio_mix_callback(void* userdata, uint8_t* out, int len) {
+    size_t frames = len / (snd_spec.channels * sizeof(int16_t));
+    memset(out, 0, len);
+    for (int i = 0; i < snd_voice_count; i++) {
+        qrt_audio* a = snd_voices[i];
+        if (!atomic_load_explicit(&a->playing, memory_order_relaxed)) continue;
+        if (!audio_render(a, frames)) continue;
+        uint32_t gain = atomic_load_explicit(&a->gain, memory_order_relaxed);
+        if (!gain) continue;
+        if (a->channels < snd_spec.channels) audio_upmix(snd_scratch, frames, snd_spec.channels);
+        audio_mix_s16((int16_t*) out, snd_scratch, frames * snd_spec.channels, gain);
+    }
+}
+
+// The first audio cap sets up the device, at its rate if the device can do
+// it (Audio_NoFmtConversion insists on it). Later caps at another rate are
+// resampled, Audio_NoFmtConversion ones included.
+static qrt_audio* audio_new(cap_t au_cap, Audio_Opts opts, size_t channels, size_t sample_rate, size_t samples_per_chunk) {
+    if (!snd_device) {
+        SDL_AudioSpec spec = {0};
+        spec.freq = sample_rate;
+        spec.format = AUDIO_S16;
+        spec.channels = channels;
+        // "This number should be a power of two":
+        // measured in sample-frames (groups of samples for all channels)
+        spec.samples = samples_per_chunk; // the App learns the actual size from Audio_FrameCount
+        spec.callback = audio_mix_callback;
+        int allow = SDL_AUDIO_ALLOW_SAMPLES_CHANGE;
+        if (opts != Audio_NoFmtConversion) allow |= SDL_AUDIO_ALLOW_FREQUENCY_CHANGE;
+        snd_device = SDL_OpenAudioDevice(NULL, 0, &spec, &snd_spec, allow);
+        if (snd_device <= 0) {
+            printf("[RT] SDL_OpenAudioDevice: %s\n", SDL_GetError());
+            snd_device = 0;
+            return 0;
+        }
+        snd_scratch = malloc(snd_spec.samples * snd_spec.channels * sizeof(int16_t));
+        SDL_Thread* t = SDL_CreateThread(audio_refill_main, "audio-refill", NULL);
+        if (!t) {
+            printf("[RT] SDL_CreateThread: %s\n", SDL_GetError());
+        } else {
+            SDL_DetachThread(t);
+        }
+        SDL_PauseAudioDevice(snd_device, 0); // mixes silence until a cap plays
+    }
+    uint32_t format = opts >= Audio_Fmt_U8 && opts <= Audio_Fmt_S32 ? opts : Audio_Fmt_S16;
+    uint32_t rate = snd_spec.freq;
+    if ((channels != 1 && channels != snd_spec.channels) || !sample_rate
+            || sample_rate > (size_t) rate * AUDIO_MAX_RATIO || sample_rate * AUDIO_MAX_RATIO < rate) {
+        printf("[RT] Audio: %zu channels at %zu Hz do not fit the device (%d at %u Hz)\n",
+               channels, sample_rate, snd_spec.channels, rate);
+        return 0;
+    }
+    if (snd_voice_count == AUDIO_MAX_VOICES) {
+        printf("[RT] Audio: too many streams (%d)\n", AUDIO_MAX_VOICES);
+        return 0;
+    }
+    qrt_audio* a = calloc(1, sizeof(qrt_audio));
+    a->cap = au_cap;
+    a->channels = channels;
+    a->format = format;
+    a->frame_bytes = channels * audio_sample_bytes(format);
+    a->rate = sample_rate;
+    a->quality = Audio_QualityDefault;
+    uint32_t in_frames = snd_spec.samples;
+    if (sample_rate != rate) {
+        a->rs = audio_resampler_new(sample_rate, rate, channels, a->quality, snd_spec.samples);
+        in_frames = a->rs->size;
+    }
+    a->chunk_bytes = (uint32_t)(((uint64_t) snd_spec.samples * sample_rate + rate - 1) / rate) * a->frame_bytes;
+    a->raw = malloc(in_frames * a->frame_bytes);
+    if (format != Audio_Fmt_S16) a->pcm = malloc(in_frames * channels * sizeof(int16_t));
+    atomic_init(&a->gain, AUDIO_GAIN_UNITY);
+    return a;
+}
+
+static void audio_attach(cap_t au_cap, qrt_audio* a) {
+    capinfo* c = qrt_cap(au_cap);
+    if (c->kind == CAP_KIND_AUDIO) audio_drop(c->buf); // created again
+    c->buf = a;
+    c->size = a->chunk_bytes / a->frame_bytes;
+    c->kind = CAP_KIND_AUDIO;
+    SDL_LockAudioDevice(snd_device);
+    snd_voices[snd_voice_count++] = a;
+    SDL_UnlockAudioDevice(snd_device);
+}
+
+static void audio_drop(void* audio) {
+    SDL_LockAudioDevice(snd_device);
+    for (int i = 0; i < snd_voice_count; i++) {
+        if (snd_voices[i] == audio) {
+            snd_voices[i] = snd_voices[--snd_voice_count];
+            break;
+        }
+    }
+    SDL_UnlockAudioDevice(snd_device);
+    audio_free(audio); // the mixer no longer sees it
+}
+
+static qrt_audio* audio_of(cap_t au_cap) {
+    capinfo* c = qrt_cap_live(au_cap);
+    return c && c->kind == CAP_KIND_AUDIO ? c->buf : 0;
+}
+
+void Audio_Create(cap_t au_cap, cap_t s_queue, Audio_Opts opts, size_t channels, size_t sample_rate, size_t samples_per_chunk) {
+    qrt_audio* a = audio_new(au_cap, opts, channels, sample_rate, samples_per_chunk);
+    if (!a) return;
+    // playing from the start: silent until the first Audio_Submit.
+    a->queue = s_queue;
+    atomic_init(&a->playing, 1);
+    uint32_t ring = 4096;
+    while (ring < AUDIO_RING_CHUNKS * a->chunk_bytes) ring <<= 1;
+    a->ring = malloc(ring);
+    a->ring_mask = ring - 1;
+    atomic_init(&a->target, AUDIO_LATENCY_CHUNKS * a->chunk_bytes);
+    a->stage = qrt_cap_alloc();
+    if (a->stage) Buffer_Create(a->stage, a->chunk_bytes, 0);
+    if (s_queue) qrt_queue(s_queue); // create it here rather than on the audio thread
+    audio_attach(au_cap, a);
+    audio_request_refill(a, 0); // ask for the first chunks
+}
+
+void Audio_SetLatency(cap_t au_cap, size_t latency_ms) {
+    qrt_audio* a = audio_of(au_cap);
+    if (!a || a->callback) return;
+    size_t bytes = latency_ms * a->rate / 1000 * a->frame_bytes;
+    if (bytes < a->chunk_bytes) bytes = a->chunk_bytes;
+    if (bytes > a->ring_mask + 1 - a->chunk_bytes) bytes = a->ring_mask + 1 - a->chunk_bytes;
+    atomic_store_explicit(&a->target, (uint32_t) bytes, memory_order_relaxed);
+}
+
+void Audio_SetGain(cap_t au_cap, float gain) {
+    qrt_audio* a = audio_of(au_cap);
+    if (!a) return;
+    if (gain < 0) gain = 0;
+    uint32_t g = (uint32_t)(gain * AUDIO_GAIN_UNITY + 0.5f);
+    if (g > INT16_MAX) g = INT16_MAX;
+    atomic_store_explicit(&a->gain, g, memory_order_relaxed);
+}
+
+void Audio_SetQuality(cap_t au_cap, Audio_Quality quality) {
+    qrt_audio* a = audio_of(au_cap);
+    if (!a || a->quality == quality) return;
+    a->quality = quality;
+    if (!a->rs) return; // used once the rates differ
+    qrt_resampler* rs = audio_resampler_new(a->rate, snd_spec.freq, a->channels, quality, snd_spec.samples);
+    if (rs->size > a->rs->size) {
+        uint8_t* raw = malloc(rs->size * a->frame_bytes);
+        int16_t* pcm = a->pcm ? malloc(rs->size * a->channels * sizeof(int16_t)) : 0;
+        SDL_LockAudioDevice(snd_device);
+        uint8_t* old_raw = a->raw;
+        int16_t* old_pcm = a->pcm;
+        a->raw = raw;
+        a->pcm = pcm;
+        SDL_UnlockAudioDevice(snd_device);
+        free(old_raw);
+        free(old_pcm);
+    }
+    SDL_LockAudioDevice(snd_device);
+    qrt_resampler* old = a->rs;
+    a->rs = rs;
+    SDL_UnlockAudioDevice(snd_device);
+    free(old);
+}
+
+void Audio_Submit(cap_t au_cap, cap_t buf_cap) {
+    qrt_audio* a = audio_of(au_cap);
+    if (!a || a->callback) return;
+    const uint8_t* data = Buffer_Address(buf_cap);
+    uint32_t len = Buffer_Size(buf_cap);
+    uint32_t w = atomic_load_explicit(&a->write, memory_order_relaxed);
+    uint32_t space = a->ring_mask + 1 - (w - atomic_load_explicit(&a->read, memory_order_acquire));
+    if (len > space) len = space - space % a->frame_bytes; // never block: drop the excess
+    uint32_t ofs = w & a->ring_mask;
+    uint32_t first = a->ring_mask + 1 - ofs;
+    if (first > len) first = len;
+    memcpy(a->ring + ofs, data, first);
+    memcpy(a->ring, data + first, len - first);
+    atomic_store_explicit(&a->write, w + len, memory_order_release);
+    atomic_store_explicit(&a->refill, AUDIO_REFILL_IDLE, memory_order_release); // the mixer may ask again
+}
+
 void Audio_CreateStream(cap_t au_cap, Audio_StreamCallback callback, Audio_Opts opts, size_t channels, size_t sample_rate, size_t samples_per_chunk) {
-    SDL_AudioSpec spec = {0};
-    SDL_AudioSpec obtained = {0};
-    spec.freq = sample_rate;
-    spec.format = AUDIO_S16;
-    spec.channels = channels;
-    // "This number should be a power of two":
-    // measured in sample-frames (groups of samples for all channels)
-    spec.samples = samples_per_chunk;
-    spec.callback = callback;
-    uint32_t device = SDL_OpenAudioDevice(NULL, 0, &spec, &obtained, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
-    if (device <= 0) {
-        printf("[RT] SDL_OpenAudioDevice: %s\n", SDL_GetError());
-        return;
+    qrt_audio* a = audio_new(au_cap, opts, channels, sample_rate, samples_per_chunk);
+    if (!a) return;
+    // plays from Audio_Start.
+    a->callback = callback;
+    a->cmds = malloc(AUDIO_COMMANDS * sizeof(Audio_Command));
+    audio_attach(au_cap, a);
+}
+
+// Wait-free in both directions: a full channel drops the command, and the
+// callback stops at the first command meant for a later chunk.
+int Audio_PostCommand(cap_t au_cap, const Audio_Command* cmd) {
+    qrt_audio* a = audio_of(au_cap);
+    if (!a || !a->cmds) return 0;
+    uint32_t w = atomic_load_explicit(&a->cmd_write, memory_order_relaxed);
+    if (w - atomic_load_explicit(&a->cmd_read, memory_order_acquire) == AUDIO_COMMANDS) {
+        atomic_fetch_add_explicit(&a->cmd_dropped, 1, memory_order_relaxed);
+        return 0;
     }
-    caps[au_cap].aud = device;
-    caps[au_cap].size = obtained.samples;
+    a->cmds[w & (AUDIO_COMMANDS - 1)] = *cmd;
+    atomic_store_explicit(&a->cmd_write, w + 1, memory_order_release);
+    return 1;
 }
 
-size_t Audio_FrameCount(cap_t au_cap) {
-    if (caps[au_cap].aud != 0) {
-        return caps[au_cap].size;
+int Audio_ReadCommand(cap_t au_cap, Audio_Command* cmd) {
+    qrt_audio* a = audio_of(au_cap);
+    if (!a || !a->cmds) return 0;
+    uint32_t r = atomic_load_explicit(&a->cmd_read, memory_order_relaxed);
+    if (r == atomic_load_explicit(&a->cmd_write, memory_order_acquire)) return 0;
+    const Audio_Command* c = &a->cmds[r & (AUDIO_COMMANDS - 1)];
+    if (c->frame >= a->chunk_end) return 0; // for a later chunk
+    *cmd = *c;
+    if (cmd->frame && cmd->frame < atomic_load_explicit(&a->frames, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&a->cmd_late, 1, memory_order_relaxed);
     }
-    return 0;
+    atomic_fetch_add_explicit(&a->cmd_read_total, 1, memory_order_relaxed);
+    atomic_store_explicit(&a->cmd_read, r + 1, memory_order_release);
+    return 1;
+}
+
+uint64_t Audio_Position(cap_t au_cap) {
+    qrt_audio* a = audio_of(au_cap);
+    return a ? atomic_load_explicit(&a->frames, memory_order_relaxed) : 0;
+}
+
+void Audio_GetStats(cap_t au_cap, Audio_Stats* stats) {
+    qrt_audio* a = audio_of(au_cap);
+    memset(stats, 0, sizeof(Audio_Stats));
+    if (!a) return;
+    stats->commands = atomic_load_explicit(&a->cmd_read_total, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&a->cmd_dropped, memory_order_relaxed);
+    stats->late = atomic_load_explicit(&a->cmd_late, memory_order_relaxed);
+}
+
+size_t Audio_FrameCount(cap_t au_cap) {
+    return audio_of(au_cap) ? qrt_cap(au_cap)->size : 0;
 }
 
 void Audio_Start(cap_t au_cap) {
-    // start pull-mode audio playback.
-    if (caps[au_cap].aud != 0) {
-        SDL_PauseAudioDevice(caps[au_cap].aud, 0);
-    }
+    qrt_audio* a = audio_of(au_cap);
+    if (a) atomic_store_explicit(&a->playing, 1, memory_order_relaxed);
 }
 
 void Audio_Stop(cap_t au_cap) {
-    // stop pull-mode audio playback.
-    if (caps[au_cap].aud != 0) {
-        SDL_PauseAudioDevice(caps[au_cap].aud, 1);
-    }
+    qrt_audio* a = audio_of(au_cap);
+    if (a) atomic_store_explicit(&a->playing, 0, memory_order_relaxed);
 }
 
 
@@ -644,4 +3723,6 @@ void Audio_Stop(cap_t au_cap) {
 // INPUT
 
 void Input_Subscribe(cap_t i_cap, Input_Opts opts, cap_t queue_cap) {
+    // input is pumped from SDL into the service queue.
+    if (queue_cap) svc_queue = queue_cap;
 }
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
 
 
 typedef enum System_EventE {
@@ -13,6 +14,7 @@ typedef enum System_EventE {
 
 // Nominates a capability known to this process/context.
 // Capabilities are local names for devices and buffers.
+// Handles always fit in 32 bits, so events carry them in MasqEventHeader.cap.
 typedef size_t cap_t;
 typedef size_t cap_token_t;
 
@@ -30,35 +32,110 @@ void System_AcceptCapability(cap_t sender, size_t token, void* io_address, size_
 
 // TASKS
 
-void Task_Create(int (*fn)(void* args), void* args);
+// Tasks run on a pool of worker threads (one per core) with work stealing.
+// A task_t can be joined any time; there is nothing to release. Tasks that
+// loop or block for a long time hold a worker: use Task_CreateThread.
+typedef uint64_t task_t;
+
+// Counts unfinished tasks created with it; zero-initialise before use.
+typedef struct Task_CounterS {
+    uint32_t pending;
+} Task_Counter;
+
+task_t Task_Create(int (*fn)(void* args), void* args);
+task_t Task_CreateCounted(Task_Counter* counter, int (*fn)(void* args), void* args);
+void Task_Join(task_t task); // runs other tasks while waiting
+void Task_WaitCounter(Task_Counter* counter); // until 'pending' is 0; runs other tasks while waiting
+void Task_CreateThread(int (*fn)(void* args), void* args); // dedicated thread
+
+// Fibers are tasks with their own stack (0 = 64 KiB). Where a thread would
+// block in Queue_Wait (no timeout), Storage_CopyToMemory, Task_Join or
+// Task_WaitCounter, a fiber instead yields its worker to other tasks.
+// A fiber may continue on another worker thread after yielding.
+task_t Task_CreateFiber(Task_Counter* counter, int (*fn)(void* args), void* args, size_t stack_size);
 
 
 // MUTEXES
 
+// A futex word; needs no allocation and nothing to destroy. Not
+// recursive. The uncontended lock and unlock are one atomic op each.
 typedef struct mutex_s {
-	void* m;
+	_Atomic uint32_t state; // 0 free, 1 locked, 2 locked with sleepers
 } mutex_t;
 
-void Mutex_Init(mutex_t* mu);
-void Mutex_Lock(mutex_t* mu);
-void Mutex_Unlock(mutex_t* mu);
+#define MUTEX_INIT { 0 }
 
+void Mutex_LockSlow(mutex_t* mu);
+void Mutex_UnlockSlow(mutex_t* mu);
 
-// ATOMICS
+static inline void Mutex_Init(mutex_t* mu) {
+    atomic_init(&mu->state, 0);
+}
 
-typedef struct Atomic_Int_S { int value; } Atomic_Int;
-void Atomic_Set_Int(Atomic_Int* var, int value);
-int Atomic_Get_Int(Atomic_Int* var);
-int Atomic_CAS_Int(Atomic_Int* var, int old_val, int new_val);
+static inline void Mutex_Lock(mutex_t* mu) {
+    uint32_t s = 0;
+    if (!atomic_compare_exchange_strong_explicit(&mu->state, &s, 1,
+            memory_order_acquire, memory_order_relaxed)) {
+        Mutex_LockSlow(mu);
+    }
+}
 
-typedef struct Atomic_Ptr_S { void* ptr; } Atomic_Ptr;
-void Atomic_Set_Ptr(Atomic_Ptr* var, void* ptr);
-void Atomic_Set_Ptr_Release(Atomic_Ptr* var, void* ptr);
-void* Atomic_Get_Ptr(Atomic_Ptr* var);
-void* Atomic_Get_Ptr_Acquire(Atomic_Ptr* var);
+static inline void Mutex_Unlock(mutex_t* mu) {
+    if (atomic_exchange_explicit(&mu->state, 0, memory_order_release) != 1) {
+        Mutex_UnlockSlow(mu); // there were sleepers
+    }
+}
+
+
+// ATOMICS
 
-// Returns 1 if old_ptr matched and the swap was performed, 0 otherwise.
-int Atomic_CAS_Ptr(Atomic_Ptr* var, void* old_ptr, void* new_ptr);
+// Inline C11 atomics. The unsuffixed operations are sequentially
+// consistent; _Relaxed, _Acquire and _Release name weaker orders.
+// Add and Swap return the previous value. CAS returns 1 if the old
+// value matched and the swap was performed, 0 otherwise.
+
+typedef struct Atomic_Int_S { _Atomic int value; } Atomic_Int;
+
+static inline void Atomic_Set_Int(Atomic_Int* var, int value) { atomic_store(&var->value, value); }
+static inline void Atomic_Set_Int_Relaxed(Atomic_Int* var, int value) { atomic_store_explicit(&var->value, value, memory_order_relaxed); }
+static inline void Atomic_Set_Int_Release(Atomic_Int* var, int value) { atomic_store_explicit(&var->value, value, memory_order_release); }
+static inline int Atomic_Get_Int(Atomic_Int* var) { return atomic_load(&var->value); }
+static inline int Atomic_Get_Int_Relaxed(Atomic_Int* var) { return atomic_load_explicit(&var->value, memory_order_relaxed); }
+static inline int Atomic_Get_Int_Acquire(Atomic_Int* var) { return atomic_load_explicit(&var->value, memory_order_acquire); }
+static inline int Atomic_Add_Int(Atomic_Int* var, int value) { return atomic_fetch_add(&var->value, value); }
+static inline int Atomic_Add_Int_Relaxed(Atomic_Int* var, int value) { return atomic_fetch_add_explicit(&var->value, value, memory_order_relaxed); }
+static inline int Atomic_Swap_Int(Atomic_Int* var, int value) { return atomic_exchange(&var->value, value); }
+static inline int Atomic_CAS_Int(Atomic_Int* var, int old_val, int new_val) {
+    return atomic_compare_exchange_strong(&var->value, &old_val, new_val);
+}
+
+typedef struct Atomic_I64_S { _Atomic int64_t value; } Atomic_I64;
+
+static inline void Atomic_Set_I64(Atomic_I64* var, int64_t value) { atomic_store(&var->value, value); }
+static inline void Atomic_Set_I64_Relaxed(Atomic_I64* var, int64_t value) { atomic_store_explicit(&var->value, value, memory_order_relaxed); }
+static inline void Atomic_Set_I64_Release(Atomic_I64* var, int64_t value) { atomic_store_explicit(&var->value, value, memory_order_release); }
+static inline int64_t Atomic_Get_I64(Atomic_I64* var) { return atomic_load(&var->value); }
+static inline int64_t Atomic_Get_I64_Relaxed(Atomic_I64* var) { return atomic_load_explicit(&var->value, memory_order_relaxed); }
+static inline int64_t Atomic_Get_I64_Acquire(Atomic_I64* var) { return atomic_load_explicit(&var->value, memory_order_acquire); }
+static inline int64_t Atomic_Add_I64(Atomic_I64* var, int64_t value) { return atomic_fetch_add(&var->value, value); }
+static inline int64_t Atomic_Add_I64_Relaxed(Atomic_I64* var, int64_t value) { return atomic_fetch_add_explicit(&var->value, value, memory_order_relaxed); }
+static inline int64_t Atomic_Swap_I64(Atomic_I64* var, int64_t value) { return atomic_exchange(&var->value, value); }
+static inline int Atomic_CAS_I64(Atomic_I64* var, int64_t old_val, int64_t new_val) {
+    return atomic_compare_exchange_strong(&var->value, &old_val, new_val);
+}
+
+typedef struct Atomic_Ptr_S { void* _Atomic ptr; } Atomic_Ptr;
+
+static inline void Atomic_Set_Ptr(Atomic_Ptr* var, void* ptr) { atomic_store(&var->ptr, ptr); }
+static inline void Atomic_Set_Ptr_Relaxed(Atomic_Ptr* var, void* ptr) { atomic_store_explicit(&var->ptr, ptr, memory_order_relaxed); }
+static inline void Atomic_Set_Ptr_Release(Atomic_Ptr* var, void* ptr) { atomic_store_explicit(&var->ptr, ptr, memory_order_release); }
+static inline void* Atomic_Get_Ptr(Atomic_Ptr* var) { return atomic_load(&var->ptr); }
+static inline void* Atomic_Get_Ptr_Relaxed(Atomic_Ptr* var) { return atomic_load_explicit(&var->ptr, memory_order_relaxed); }
+static inline void* Atomic_Get_Ptr_Acquire(Atomic_Ptr* var) { return atomic_load_explicit(&var->ptr, memory_order_acquire); }
+static inline void* Atomic_Swap_Ptr(Atomic_Ptr* var, void* ptr) { return atomic_exchange(&var->ptr, ptr); }
+static inline int Atomic_CAS_Ptr(Atomic_Ptr* var, void* old_ptr, void* new_ptr) {
+    return atomic_compare_exchange_strong(&var->ptr, &old_ptr, new_ptr);
+}
 
 
 // BUFFER [P]
@@ -71,11 +148,32 @@ void* Buffer_Create(cap_t cap, size_t size, cap_t io_cap); // SYSCALL
 void* Buffer_Address(cap_t cap); // in memory
 size_t Buffer_Size(cap_t cap); // in memory
 
+typedef enum Buffer_OptsE {
+    Buffer_HugePages = 1, // back with huge pages if the host has them (size rounds up to 2 MiB)
+} Buffer_Opts;
+
+// Shared buffers are page-aligned; size_pg is in 4 KiB pages.
 void* Buffer_CreateShared(cap_t sb_cap, size_t size_pg); // SYSCALL
+void* Buffer_CreateSharedOpts(cap_t sb_cap, size_t size_pg, Buffer_Opts opts); // SYSCALL
+// Maps the shared pages into io_cap's buffer at a page-aligned offset (zero copy).
+// io_cap must be a shared buffer or a buffer of at least 64 KiB.
 void Buffer_MapShared(cap_t sb_cap, size_t io_area_ofs, cap_t io_cap); // SYSCALL
 
 void Buffer_Destroy(cap_t cap);
 
+// Buffers up to 32 KiB come from pooled power-of-two size classes
+// (64-byte aligned), recycled through per-thread caches; 32-64 KiB are
+// malloc'd, and 64 KiB and up are page-mapped.
+typedef struct Buffer_PoolStatsE {
+    size_t block_size;
+    uint64_t allocs;
+    uint64_t hits;           // allocations served by recycled blocks
+    size_t live_bytes;
+    size_t high_water_bytes;
+} Buffer_PoolStats;
+
+size_t Buffer_GetPoolStats(Buffer_PoolStats* stats, size_t count); // returns the number of classes
+
 
 // QUEUES [P]
 
@@ -89,8 +187,28 @@ typedef struct MasqEventE {
     MasqEventHeader h;
 } MasqEvent;
 
+// Each queue is a lock-free ring with one producer and one consumer.
+// Events are variable-length records; 'size' in the header covers the whole event.
+// Input, quit and frame events go to the service queue: the queue passed to
+// FrameBuffer_Create or Input_Subscribe, else the first queue the main thread
+// reads. SDL events are pumped when the main thread reads or waits on it.
+
 void Queue_New(cap_t q_cap, size_t io_area_ofs, uint32_t size_pow2);
-void Queue_Wait(cap_t q_cap);
-MasqEventHeader* Queue_Read(cap_t q_cap);
+void Queue_Wait(cap_t q_cap); // block the consumer until the queue is not empty
+int Queue_WaitTimeout(cap_t q_cap, int timeout_ms); // returns 0 on timeout; < 0 waits forever
+MasqEventHeader* Queue_Read(cap_t q_cap); // points into the queue; valid until Queue_Advance
 void Queue_Advance(cap_t q_cap);
+
+// Returns a contiguous run of 'count' events starting at *first (0 if empty);
+// step through it with Queue_NextEvent, then Queue_Advance releases them all.
+size_t Queue_ReadBatch(cap_t q_cap, MasqEventHeader** first);
+static inline MasqEventHeader* Queue_NextEvent(MasqEventHeader* ev) {
+    return (MasqEventHeader*)((uint8_t*)ev + ((ev->size + 7) & ~7));
+}
 int Queue_Empty(cap_t q_cap);
+
+// Producer side: reserve space for one or more events, fill them in, then
+// Commit to publish them all at once. Reserve sets 'size'; returns 0 if full.
+MasqEventHeader* Queue_Reserve(cap_t q_cap, size_t size);
+void Queue_Commit(cap_t q_cap);
+int Queue_Post(cap_t q_cap, const MasqEventHeader* ev); // copy in one event; returns 1 if posted
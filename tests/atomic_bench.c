@@ -0,0 +1,72 @@
+// Atomic_* microbenchmark: the inline stdatomic operations in qrt_system.h
+// against the out-of-line SDL wrappers they replaced (kept below, as they
+// were). Single thread, uncontended: this measures call and fence overhead.
+//
+//   atomic_bench [iterations]
+
+#include "qrt_system.h"
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// The previous implementation, one call per operation.
+__attribute__((noinline)) static void Old_Set_Int(Atomic_Int* var, int value) {
+    SDL_AtomicSet((SDL_atomic_t*)var, value);
+}
+__attribute__((noinline)) static int Old_Get_Int(Atomic_Int* var) {
+    return SDL_AtomicGet((SDL_atomic_t*)var);
+}
+__attribute__((noinline)) static int Old_CAS_Int(Atomic_Int* var, int old_val, int new_val) {
+    return SDL_AtomicCAS((SDL_atomic_t*)var, old_val, new_val);
+}
+__attribute__((noinline)) static void Old_Set_Ptr_Release(Atomic_Ptr* var, void* ptr) {
+    SDL_MemoryBarrierReleaseFunction();
+    SDL_AtomicSetPtr((void**)&var->ptr, ptr);
+}
+__attribute__((noinline)) static void* Old_Get_Ptr_Acquire(Atomic_Ptr* var) {
+    void* p = SDL_AtomicGetPtr((void**)&var->ptr);
+    SDL_MemoryBarrierAcquireFunction();
+    return p;
+}
+
+static long iterations;
+static Atomic_Int ai;
+static Atomic_Ptr ap;
+static volatile intptr_t sink;
+
+static double ns_per_op(Uint64 t0) {
+    return (double)(SDL_GetPerformanceCounter() - t0) * 1e9 / SDL_GetPerformanceFrequency() / iterations;
+}
+
+#define BENCH(name, body) do { \
+        Uint64 t0 = SDL_GetPerformanceCounter(); \
+        for (long i = 0; i < iterations; i++) { body; } \
+        printf("%-28s %6.2f ns\n", name, ns_per_op(t0)); \
+    } while (0)
+
+int main(int argc, char** argv) {
+    iterations = argc > 1 ? atol(argv[1]) : 20000000;
+    intptr_t acc = 0;
+
+    BENCH("old Set_Int", Old_Set_Int(&ai, (int) i));
+    BENCH("Atomic_Set_Int (seq_cst)", Atomic_Set_Int(&ai, (int) i));
+    BENCH("Atomic_Set_Int_Release", Atomic_Set_Int_Release(&ai, (int) i));
+
+    BENCH("old Get_Int", acc += Old_Get_Int(&ai));
+    BENCH("Atomic_Get_Int (seq_cst)", acc += Atomic_Get_Int(&ai));
+    BENCH("Atomic_Get_Int_Acquire", acc += Atomic_Get_Int_Acquire(&ai));
+
+    BENCH("old CAS_Int", acc += Old_CAS_Int(&ai, (int) i, (int) i + 1));
+    BENCH("Atomic_CAS_Int", acc += Atomic_CAS_Int(&ai, (int) i, (int) i + 1));
+
+    BENCH("old Set_Ptr_Release", Old_Set_Ptr_Release(&ap, (void*) i));
+    BENCH("Atomic_Set_Ptr_Release", Atomic_Set_Ptr_Release(&ap, (void*) i));
+
+    BENCH("old Get_Ptr_Acquire", acc += (intptr_t) Old_Get_Ptr_Acquire(&ap));
+    BENCH("Atomic_Get_Ptr_Acquire", acc += (intptr_t) Atomic_Get_Ptr_Acquire(&ap));
+
+    BENCH("Atomic_Add_Int_Relaxed", acc += Atomic_Add_Int_Relaxed(&ai, 1));
+    sink = acc;
+    return 0;
+}
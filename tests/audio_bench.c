@@ -0,0 +1,58 @@
+// Audio conversion throughput for each source format and rate against the
+// device spec, at each resampling quality: ns per device frame spent
+// turning one voice's input into S16 at the device rate, and how many
+// times faster than real time that is. Test-only TU: it includes the
+// runtime to time audio_render directly (the device is opened paused).
+//
+//   audio_bench [chunks]
+
+#include "../qrt_system.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_CAP 11
+
+static void fill(void* userdata, uint8_t* stream, int len) {
+    for (int i = 0; i < len; i++) stream[i] = (uint8_t) rand();
+}
+
+static void skip(void* userdata, uint8_t* stream, int len) {
+    // keep the input from the warm-up chunk: only conversion is timed.
+}
+
+int main(int argc, char** argv) {
+    int chunks = argc > 1 ? atoi(argv[1]) : 2000;
+    if (!getenv("SDL_AUDIODRIVER")) setenv("SDL_AUDIODRIVER", "dummy", 1);
+    System_Init();
+    Audio_CreateStream(BENCH_CAP, skip, Audio_Fmt_S16, 2, 48000, 512);
+    if (!snd_device) return 1;
+    SDL_PauseAudioDevice(snd_device, 1); // audio_render runs here instead
+    System_DropCapability(BENCH_CAP);
+    uint32_t frames = snd_spec.samples;
+    printf("device: %d Hz, %d channels, %u frames per chunk\n", snd_spec.freq, snd_spec.channels, frames);
+    printf("quality  format  rate    ns/frame  x realtime\n");
+
+    static const int formats[] = {Audio_Fmt_U8, Audio_Fmt_S16, Audio_Fmt_S24, Audio_Fmt_S32};
+    static const char* format_names[] = {"U8", "S16", "S24", "S32"};
+    static const char* quality_names[] = {"fast", "default", "best"};
+    const int rates[] = {snd_spec.freq, 44100, 22050, 96000};
+    for (int q = Audio_QualityFast; q <= Audio_QualityBest; q++) {
+        for (int r = 0; r < 4; r++) {
+            for (int f = 0; f < 4; f++) {
+                Audio_CreateStream(BENCH_CAP, fill, formats[f], snd_spec.channels, rates[r], frames);
+                Audio_SetQuality(BENCH_CAP, q);
+                qrt_audio* a = audio_of(BENCH_CAP);
+                if (!a) continue;
+                audio_render(a, frames); // warm up the filter history and fill the input
+                a->callback = skip;
+                Uint64 t0 = SDL_GetPerformanceCounter();
+                for (int i = 0; i < chunks; i++) audio_render(a, frames);
+                double ns = (double)(SDL_GetPerformanceCounter() - t0) * 1e9 / SDL_GetPerformanceFrequency() / ((double) chunks * frames);
+                printf("%-7s  %-6s  %5d  %8.2f  %10.0f\n", quality_names[q], format_names[f], rates[r], ns, 1e9 / snd_spec.freq / ns);
+                System_DropCapability(BENCH_CAP);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+// Checks the SIMD row kernels against the scalar one, and all of them
+// against plain nearest-neighbour: output pixel x shows source pixel x/scale.
+
+#include "qrt_fb_expand.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_WIDTH 70
+#define MAX_SCALE 5
+
+static int check(const char* name, fb_expand_fn fn, const uint8_t* from, const uint32_t* pal) {
+    static uint32_t want[MAX_WIDTH * MAX_SCALE + 1], got[MAX_WIDTH * MAX_SCALE + 1];
+    int failed = 0;
+    for (int scale = 1; scale <= MAX_SCALE; scale++) {
+        for (size_t width = 0; width < MAX_WIDTH; width++) {
+            size_t n = width * scale;
+            for (size_t x = 0; x < n; x++) want[x] = pal[from[x / scale]];
+            want[n] = 0xDEADBEEF; // nothing is written past the row
+            memcpy(got, want, sizeof(got));
+            memset(got, 0, n * sizeof(uint32_t));
+            fn(got, from, width, pal, scale);
+            if (memcmp(got, want, (n + 1) * sizeof(uint32_t))) {
+                printf("%s: mismatch at width %zu scale %d\n", name, width, scale);
+                failed = 1;
+            }
+        }
+    }
+    return failed;
+}
+
+int main(void) {
+    uint8_t from[MAX_WIDTH];
+    uint32_t pal[256];
+    srand(1);
+    for (int i = 0; i < MAX_WIDTH; i++) from[i] = rand() & 0xFF;
+    for (int i = 0; i < 256; i++) pal[i] = 0xFF000000u | (uint32_t) rand() << 8 | i;
+
+    int failed = check("c", fb_expand_row_c, from, pal);
+#ifdef QRT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) failed |= check("sse2", fb_expand_row_sse2, from, pal);
+    if (__builtin_cpu_supports("avx2")) failed |= check("avx2", fb_expand_row_avx2, from, pal);
+    else printf("avx2: not supported here, skipped\n");
+#endif
+    if (!failed) printf("ok\n");
+    return failed;
+}
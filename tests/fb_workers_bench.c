@@ -0,0 +1,62 @@
+// Scaling curve for FrameBuffer_SetWorkers: converts full 8-bit frames
+// (every row changed) headless with 1..N workers and prints the time per
+// frame and the speedup over one worker.
+//
+//   fb_workers_bench [width height [frames]]
+
+#include "platform.h"
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FB_CAP 2
+#define QUEUE_CAP 9
+#define PAL_CAP 7
+
+static cap_t next_frame(void) {
+    for (;;) {
+        Queue_Wait(QUEUE_CAP);
+        MasqEventHeader* h = Queue_Read(QUEUE_CAP);
+        if (h->event == FrameBuffer_Frame && h->cap == FB_CAP) {
+            cap_t buf = ((FrameBuffer_FrameEvent*) h)->buf_cap;
+            Queue_Advance(QUEUE_CAP);
+            return buf;
+        }
+        Queue_Advance(QUEUE_CAP);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t width = argc > 2 ? strtoul(argv[1], 0, 10) : 1920;
+    size_t height = argc > 2 ? strtoul(argv[2], 0, 10) : 1080;
+    int frames = argc > 3 ? atoi(argv[3]) : 100;
+    setenv("QRT_HEADLESS", "1", 1);
+    System_Init();
+    Queue_New(QUEUE_CAP, 0, 16);
+    uint32_t* pal = Buffer_Create(PAL_CAP, 256 * sizeof(uint32_t), 0);
+    for (int i = 0; i < 256; i++) pal[i] = 0xFF000000u | (uint32_t) i * 0x010203u;
+    FrameBuffer_Create(FB_CAP, FrameBuffer_NoSmooth, width, height, 8, QUEUE_CAP);
+    FrameBuffer_SetPalette(FB_CAP, PAL_CAP);
+
+    int cpus = SDL_GetCPUCount();
+    double base = 0;
+    printf("%zux%zu, %d frames per run\n", width, height, frames);
+    printf("workers  ms/frame  speedup\n");
+    for (int workers = 1; workers <= cpus; workers++) {
+        FrameBuffer_SetWorkers(FB_CAP, workers);
+        FrameBuffer_Stats before, after;
+        FrameBuffer_GetStats(FB_CAP, &before);
+        for (int i = 0; i < frames; i++) {
+            cap_t buf = next_frame();
+            memset(Buffer_Address(buf), i + workers, width * height); // every row differs
+            FrameBuffer_Submit(FB_CAP, buf);
+        }
+        FrameBuffer_GetStats(FB_CAP, &after);
+        double ms = (double)(after.convert_us - before.convert_us) / (after.frames - before.frames) / 1000.0;
+        if (workers == 1) base = ms;
+        printf("%7d  %8.3f  %7.2f\n", workers, ms, base / ms);
+    }
+    return 0;
+}